@@ -0,0 +1,443 @@
+// Benchmark harness for tfwm
+//
+// Starts tfwm under Xvfb, drives it with N synthetic clients and writes the
+// measurements as JSON so runs can be compared.
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include <X11/Xlibint.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/xtestproto.h>
+
+// Configuration
+static const char* default_display = ":99";
+static const char* default_counts = "10,100,1000";
+static const int alt_tab_rounds = 50;
+static const int drag_motions = 600;
+static const int title_updates = 500;
+static const int timeout = 5000;
+
+// Global variables
+Display* display;
+Window root;
+int xtest_opcode;
+pid_t xvfb_pid = 0;
+const char* tfwm_path = "./tfwm";
+char stats_path[PATH_MAX];
+
+Atom _NET_ACTIVE_WINDOW;
+Atom _NET_CLIENT_LIST;
+
+// Helpers
+long long time_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+pid_t spawn(char* const argv[]) {
+	pid_t pid = fork();
+	if (pid == 0) {
+		execvp(argv[0], argv);
+		fprintf(stderr, "tfwm-bench: cannot run %s\n", argv[0]);
+		_exit(EXIT_FAILURE);
+	}
+	return pid;
+}
+
+void stop(pid_t pid) {
+	if (pid <= 0) return;
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+}
+
+int compare_long_long(const void* a, const void* b) {
+	long long x = *(const long long*) a;
+	long long y = *(const long long*) b;
+	return (x > y) - (x < y);
+}
+
+void print_distribution(FILE* f, long long* values, int count) {
+	if (count <= 0) {
+		fprintf(f, "null");
+		return;
+	}
+	long long sum = 0;
+	for (int i = 0; i < count; i++)
+		sum += values[i];
+	qsort(values, count, sizeof(*values), compare_long_long);
+	fprintf(f, "{\"count\":%d,\"mean\":%lld,\"p50\":%lld,\"p99\":%lld,\"max\":%lld}",
+		count, sum / count, values[count / 2], values[count * 99 / 100], values[count - 1]
+	);
+}
+
+// Waits for an event of the given type on the given window, or any window if None
+bool wait_event(int type, Window window, XEvent* e, int ms) {
+	long long deadline = time_now() + ms * 1000LL;
+	for (;;) {
+		while (XPending(display)) {
+			XNextEvent(display, e);
+			if (e->type == type && (window == None || e->xany.window == window))
+				return true;
+		}
+		long long left = deadline - time_now();
+		if (left <= 0)
+			return false;
+		struct pollfd fd = { .fd = ConnectionNumber(display), .events = POLLIN };
+		poll(&fd, 1, (left + 999) / 1000);
+	}
+}
+
+bool wait_root_property(Atom atom, XEvent* e, int ms) {
+	long long deadline = time_now() + ms * 1000LL;
+	while (time_now() < deadline) {
+		if (!wait_event(PropertyNotify, root, e, (deadline - time_now()) / 1000 + 1))
+			return false;
+		if (e->xproperty.atom == atom)
+			return true;
+	}
+	return false;
+}
+
+// XTest
+void fake_input(int type, int detail, int x, int y) {
+	Display* dpy = display;
+	xXTestFakeInputReq* req;
+	LockDisplay(dpy);
+	GetReq(XTestFakeInput, req);
+	req->reqType = xtest_opcode;
+	req->xtReqType = X_XTestFakeInput;
+	req->type = type;
+	req->detail = detail;
+	req->pad0 = 0;
+	req->time = CurrentTime;
+	req->root = type == MotionNotify ? root : None;
+	req->pad1 = req->pad2 = req->pad3 = 0;
+	req->pad4 = 0;
+	req->pad5 = 0;
+	req->rootX = x;
+	req->rootY = y;
+	req->deviceid = 0;
+	UnlockDisplay(dpy);
+	SyncHandle();
+}
+
+void fake_key(KeySym key, bool press) {
+	fake_input(press ? KeyPress : KeyRelease, XKeysymToKeycode(display, key), 0, 0);
+}
+
+// tfwm
+pid_t tfwm_start(void) {
+	char* argv[] = { (char*) tfwm_path, NULL };
+	pid_t pid = spawn(argv);
+
+	// Ready once something holds the substructure redirect on the root window
+	long long deadline = time_now() + timeout * 1000LL;
+	while (time_now() < deadline) {
+		XWindowAttributes attr;
+		XGetWindowAttributes(display, root, &attr);
+		if (attr.all_event_masks & SubstructureRedirectMask) {
+			usleep(100000);
+			return pid;
+		}
+		usleep(10000);
+	}
+	fprintf(stderr, "tfwm-bench: tfwm did not start\n");
+	stop(pid);
+	return -1;
+}
+
+bool tfwm_bar_stats(pid_t pid, unsigned long long* count, unsigned long long* total_us) {
+	unlink(stats_path);
+	kill(pid, SIGUSR1);
+	long long deadline = time_now() + timeout * 1000LL;
+	struct stat st;
+	while (stat(stats_path, &st) && time_now() < deadline)
+		usleep(10000);
+
+	FILE* f = fopen(stats_path, "r");
+	if (!f) return false;
+	char buffer[16384];
+	size_t n = fread(buffer, 1, sizeof(buffer) - 1, f);
+	buffer[n] = '\0';
+	fclose(f);
+
+	*count = *total_us = 0;
+	char* entry = strstr(buffer, "\"BarDraw\":{");
+	if (!entry) return true;
+	unsigned long long coalesced;
+	return sscanf(entry, "\"BarDraw\":{\"count\":%llu,\"coalesced\":%llu,\"total_us\":%llu",
+		count, &coalesced, total_us) == 3;
+}
+
+void tfwm_activate(Window window) {
+	XEvent event = { 0 };
+	event.type = ClientMessage;
+	event.xclient.window = window;
+	event.xclient.message_type = _NET_ACTIVE_WINDOW;
+	event.xclient.format = 32;
+	XSendEvent(display, root, false, SubstructureRedirectMask | SubstructureNotifyMask, &event);
+	XFlush(display);
+}
+
+// Benchmarks
+void bench_map(FILE* f, Window* windows, int count) {
+	long long* sent = calloc(count, sizeof(*sent));
+	long long* latency = calloc(count, sizeof(*latency));
+	long long start = time_now();
+	for (int i = 0; i < count; i++) {
+		windows[i] = XCreateSimpleWindow(display, root, 0, 0, 320, 240, 0, 0, 0xffffff);
+		XSelectInput(display, windows[i], StructureNotifyMask);
+		sent[i] = time_now();
+		XMapWindow(display, windows[i]);
+		XFlush(display);
+	}
+
+	int mapped = 0;
+	XEvent e;
+	while (mapped < count && wait_event(MapNotify, None, &e, timeout)) {
+		for (int i = 0; i < count; i++) {
+			if (windows[i] != e.xmap.window)
+				continue;
+			latency[mapped++] = time_now() - sent[i];
+			break;
+		}
+	}
+	fprintf(f, "\"map\":{\"total_us\":%lld,\"mapped\":%d,\"latency_us\":", time_now() - start, mapped);
+	print_distribution(f, latency, mapped);
+	fprintf(f, "}");
+	free(sent);
+	free(latency);
+}
+
+void bench_alt_tab(FILE* f) {
+	long long* latency = calloc(alt_tab_rounds, sizeof(*latency));
+	int done = 0;
+
+	// Keep the pointer on the bar so raised windows do not steal focus
+	fake_input(MotionNotify, 0, 2, 2);
+	XSync(display, false);
+	usleep(50000);
+	XEvent e;
+	while (XPending(display))
+		XNextEvent(display, &e);
+
+	for (int i = 0; i < alt_tab_rounds; i++) {
+		long long start = time_now();
+		fake_key(XK_Alt_L, true);
+		fake_key(XK_Tab, true);
+		fake_key(XK_Tab, false);
+		fake_key(XK_Alt_L, false);
+		XFlush(display);
+		if (!wait_root_property(_NET_ACTIVE_WINDOW, &e, timeout))
+			break;
+		latency[done++] = time_now() - start;
+	}
+	fprintf(f, "\"alt_tab\":{\"latency_us\":");
+	print_distribution(f, latency, done);
+	fprintf(f, "}");
+	free(latency);
+}
+
+void bench_drag(FILE* f, Window window) {
+	XEvent e;
+	tfwm_activate(window);
+	wait_root_property(_NET_ACTIVE_WINDOW, &e, timeout);
+
+	Window unused;
+	int x, y;
+	unsigned int w, h, border, depth;
+	XGetGeometry(display, window, &unused, &x, &y, &w, &h, &border, &depth);
+	int px = x + w / 2;
+	int py = y + h / 2;
+	fake_input(MotionNotify, 0, px, py);
+	fake_key(XK_Super_L, true);
+	fake_input(ButtonPress, 1, 0, 0);
+	XSync(display, false);
+	usleep(50000);
+	while (XPending(display))
+		XNextEvent(display, &e);
+
+	// Move one pixel per event, as a real pointer does
+	long long start = time_now();
+	for (int i = 1; i <= drag_motions; i++)
+		fake_input(MotionNotify, 0, px + i % 300, py + i % 200);
+	XFlush(display);
+	long long sent = time_now() - start;
+
+	int expected_x = x + drag_motions % 300;
+	int expected_y = y + drag_motions % 200;
+	int moves = 0;
+	bool arrived = false;
+	while (!arrived && wait_event(ConfigureNotify, window, &e, timeout)) {
+		moves++;
+		arrived = e.xconfigure.x == expected_x && e.xconfigure.y == expected_y;
+	}
+	long long duration = time_now() - start;
+	fake_input(ButtonRelease, 1, 0, 0);
+	fake_key(XK_Super_L, false);
+	XSync(display, false);
+
+	fprintf(f, "\"drag\":{\"motions\":%d,\"moves\":%d,\"arrived\":%s,\"send_us\":%lld,\"duration_us\":%lld,\"motions_per_sec\":%.0f}",
+		drag_motions, moves, arrived ? "true" : "false", sent, duration,
+		duration ? drag_motions * 1e6 / duration : 0.0
+	);
+}
+
+void bench_bar(FILE* f, pid_t pid, Window window) {
+	unsigned long long count0, total0, count1, total1;
+	bool ok = tfwm_bar_stats(pid, &count0, &total0);
+	char title[64];
+	for (int i = 0; i < title_updates; i++) {
+		snprintf(title, sizeof(title), "bench %d", i);
+		XStoreName(display, window, title);
+		XFlush(display);
+	}
+	XSync(display, false);
+	usleep(500000);
+	ok = ok && tfwm_bar_stats(pid, &count1, &total1);
+	if (!ok || count1 <= count0) {
+		fprintf(f, "\"bar\":null");
+		return;
+	}
+	fprintf(f, "\"bar\":{\"title_updates\":%d,\"redraws\":%llu,\"total_us\":%llu,\"mean_us\":%llu}",
+		title_updates, count1 - count0, total1 - total0, (total1 - total0) / (count1 - count0)
+	);
+}
+
+void bench_teardown(FILE* f, Window* windows, int count) {
+	long long start = time_now();
+	for (int i = 0; i < count; i++)
+		XDestroyWindow(display, windows[i]);
+	XFlush(display);
+
+	// Done once tfwm publishes an empty client list
+	XEvent e;
+	bool done = false;
+	while (!done && wait_root_property(_NET_CLIENT_LIST, &e, timeout)) {
+		Atom type;
+		int format;
+		unsigned long items, after;
+		unsigned char* data = NULL;
+		XGetWindowProperty(display, root, _NET_CLIENT_LIST, 0, 1, false, XA_WINDOW, &type, &format, &items, &after, &data);
+		done = items == 0;
+		if (data) XFree(data);
+	}
+	fprintf(f, "\"teardown\":{\"done\":%s,\"total_us\":%lld}", done ? "true" : "false", time_now() - start);
+}
+
+void bench_run(FILE* f, int count) {
+	pid_t pid = tfwm_start();
+	if (pid < 0) {
+		fprintf(f, "{\"windows\":%d,\"error\":\"tfwm did not start\"}", count);
+		return;
+	}
+	Window* windows = calloc(count, sizeof(*windows));
+	fprintf(f, "{\"windows\":%d,", count);
+	bench_map(f, windows, count);
+	fprintf(f, ",");
+	bench_alt_tab(f);
+	fprintf(f, ",");
+	bench_drag(f, windows[0]);
+	fprintf(f, ",");
+	bench_bar(f, pid, windows[0]);
+	fprintf(f, ",");
+	bench_teardown(f, windows, count);
+	fprintf(f, "}");
+	free(windows);
+	stop(pid);
+}
+
+// Main
+void usage(void) {
+	fprintf(stderr, "usage: tfwm-bench [-e] [-d display] [-n counts] [-t tfwm] [-o output]\n");
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[]) {
+	const char* display_name = default_display;
+	const char* counts = default_counts;
+	const char* output = NULL;
+	bool existing = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "ed:n:t:o:")) != -1) {
+		switch (opt) {
+			case 'e': existing = true; break;
+			case 'd': display_name = optarg; break;
+			case 'n': counts = optarg; break;
+			case 't': tfwm_path = optarg; break;
+			case 'o': output = optarg; break;
+			default: usage();
+		}
+	}
+
+	// Start a headless server unless told to use an existing one
+	if (!existing) {
+		char* xvfb[] = { "Xvfb", (char*) display_name, "-screen", "0", "1920x1080x24", "-nolisten", "tcp", NULL };
+		xvfb_pid = spawn(xvfb);
+	}
+	long long deadline = time_now() + timeout * 1000LL;
+	while (!(display = XOpenDisplay(display_name)) && time_now() < deadline)
+		usleep(50000);
+	if (!display) {
+		fprintf(stderr, "tfwm-bench: cannot open display %s\n", display_name);
+		stop(xvfb_pid);
+		exit(EXIT_FAILURE);
+	}
+	int event_base, error_base;
+	if (!XQueryExtension(display, "XTEST", &xtest_opcode, &event_base, &error_base)) {
+		fprintf(stderr, "tfwm-bench: XTEST extension missing\n");
+		stop(xvfb_pid);
+		exit(EXIT_FAILURE);
+	}
+	setenv("DISPLAY", display_name, true);
+
+	// Same place tfwm writes its statistics to
+	const char* dir = getenv("XDG_RUNTIME_DIR");
+	if (dir)
+		snprintf(stats_path, sizeof(stats_path), "%s/tfwm%s-stats.json", dir, DisplayString(display));
+	else
+		snprintf(stats_path, sizeof(stats_path), "/tmp/tfwm-%d%s-stats.json", getuid(), DisplayString(display));
+	root = DefaultRootWindow(display);
+	_NET_ACTIVE_WINDOW = XInternAtom(display, "_NET_ACTIVE_WINDOW", false);
+	_NET_CLIENT_LIST = XInternAtom(display, "_NET_CLIENT_LIST", false);
+	XSelectInput(display, root, PropertyChangeMask);
+
+	FILE* f = output ? fopen(output, "w") : stdout;
+	if (!f) {
+		fprintf(stderr, "tfwm-bench: cannot write %s: %s\n", output, strerror(errno));
+		stop(xvfb_pid);
+		exit(EXIT_FAILURE);
+	}
+	fprintf(f, "{\"tfwm\":\"%s\",\"runs\":[", tfwm_path);
+	char* list = strdup(counts);
+	bool first = true;
+	for (char* n = strtok(list, ","); n; n = strtok(NULL, ",")) {
+		int count = atoi(n);
+		if (count <= 0)
+			continue;
+		fprintf(f, "%s", first ? "" : ",");
+		bench_run(f, count);
+		fflush(f);
+		first = false;
+	}
+	fprintf(f, "]}\n");
+	free(list);
+	if (f != stdout)
+		fclose(f);
+
+	XCloseDisplay(display);
+	stop(xvfb_pid);
+	return 0;
+}
@@ -1,15 +1,35 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <X11/cursorfont.h>
 #include <X11/Xatom.h>
 #include <X11/XKBlib.h>
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
+#include <X11/extensions/sync.h>
 #include <X11/Xft/Xft.h>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+#ifdef XRANDR
+#include <X11/extensions/Xrandr.h>
+#endif
 
 // Configuration
 static const struct shortcut {
@@ -27,6 +47,7 @@ static const struct shortcut {
 	{ XK_q,   Mod4Mask,           "!close" },
 	{ XK_w,   Mod4Mask,           "!hide" },
 	{ XK_q,   Mod4Mask|ShiftMask, "!quit" },
+	{ XK_r,   Mod4Mask|ShiftMask, "!restart" },
 };
 static const size_t shortcut_count = sizeof(shortcuts) / sizeof(shortcuts[0]);
 
@@ -48,9 +69,33 @@ static const int colors[] = {
 static const char* font = "monospace:style=bold:size=10";
 static const int bar_height = 22;
 static const int border_width = 1;
+static const bool status_builtin = true;
+static const int status_interval = 1000;
+static const char* status_time_format = "%A, %B %d, %H:%M";
+static const int drag_frame_rate = 60;
+static const int drag_sync_timeout = 100;
+static const int title_rate = 5;
+static const int focus_delay = 40;
+static const int ipc_title_max = 128;
+static const unsigned int wireframe_mask = ShiftMask;
+static const char* wireframe_classes[] = { NULL };
 
 // Definitions
 #define CLIENT_MAX_NAME_LENGHT 15
+#define CLIENT_HASH_SIZE 256
+#define CLIENT_POOL_CHUNK 64
+#define REQUEST_QUEUE_SIZE 1024
+#define EVENT_BATCH_SIZE 256
+#define LOOP_MAX_EVENTS 16
+#define STATUS_MAX_SENSORS 16
+#define STATS_BUCKETS 24
+#define STATS_BAR_DRAW (LASTEvent + 1)
+#define IPC_BUFFER_SIZE 4096
+#define SPAWN_MAX_ARGS 32
+#define OUTPUT_MAX 8
+#define REPLAY_WINDOWS 4096
+#define FONT_MAX 16
+#define FONT_CODEPOINTS 0x110000
 
 typedef enum anchor {
 	ANCHOR_NONE, ANCHOR_TOP,
@@ -59,44 +104,398 @@ typedef enum anchor {
 	ANCHOR_BOT_LEFT, ANCHOR_BOT_RIGHT,
 } anchor_t;
 
+struct timer {
+	long long deadline;
+	void (*callback)(void* data);
+	void* data;
+	bool armed;
+	struct timer* next;
+};
+
+struct text_run {
+	int font;
+	int offset, length;
+	int width;
+};
+
+typedef struct watch {
+	int fd;
+	void (*callback)(void* data);
+	void* data;
+} watch_t;
+
 typedef struct client {
 	Window window;
 	char name[CLIENT_MAX_NAME_LENGHT + 1];
+	size_t title_offset;
+	int title_length, title_capacity;
+	bool net_name;
+	long long title_next;
+	struct timer title_timer;
+	bool pending;
+	int order;
+	bool stack_moved;
+	bool restore_focus;
 	bool hidden;
+	int ignore_unmaps;
+	bool delete_window;
+	XSyncCounter sync_counter;
+	unsigned long long sync_value;
 	int x, y, w, h;
 	int px, py, pw, ph;
+	int base_w, base_h;
+	int min_w, min_h;
+	int max_w, max_h;
+	int inc_w, inc_h;
 	anchor_t anchor;
+	bool fullscreen;
+	int bypass;
+	bool wireframe;
+	int fx, fy, fw, fh;
+	int output;
+	int name_length, name_width;
+	struct text_run name_runs[CLIENT_MAX_NAME_LENGHT];
+	int name_run_count;
+	int bar_x, bar_w;
+	bool bar_dirty;
+	bool state_dirty;
+	int net_state_written;
+	long wm_state_written;
 	struct client *next;
+	struct client *hash_next;
 } client_t;
 
+struct bar_slot {
+	int x, w;
+	client_t* client;
+};
+
+typedef struct output {
+	int x, y, w, h;
+	Window bar;
+	Pixmap pixmap;
+	XftDraw* xft_draw;
+	bool dirty;
+	bool dirty_layout;
+	bool dirty_status;
+	int buttons_end;
+	int status_x;
+	struct bar_slot* layout;
+	size_t layout_count;
+	size_t layout_size;
+	bool layout_stale;
+} output_t;
+
+typedef struct drag {
+	client_t* client;
+	unsigned int button;
+	int start_x, start_y;
+	int x, y, w, h;
+	int mx, my;
+	Time time;
+	bool pending;
+	long long next_frame;
+	XSyncAlarm alarm;
+	long long sync_sent;
+	struct timer timer;
+	bool outline;
+	bool outline_drawn;
+	int ox, oy, ow, oh;
+	anchor_t outline_anchor;
+	int outline_output;
+} drag_t;
+
 // Global variables
 int screen_width;
 int screen_height;
-int view_height;
+output_t outputs[OUTPUT_MAX];
+int output_count = 0;
 
 Display* display;
+xcb_connection_t* connection;
 GC gc;
 Window root;
-Window bar;
 
-XftDraw* xft_draw;
 XftFont* xft_font;
 
 client_t* clients = NULL;
 client_t* focused = NULL;
+struct timer focus_timer = { 0 };
+client_t* client_table[CLIENT_HASH_SIZE] = { 0 };
+client_t* client_pool = NULL;
+drag_t drag = { 0 };
+
+bool sync_supported = false;
+int sync_event_base;
+#ifdef XRANDR
+bool xrandr_supported = false;
+int xrandr_event_base;
+#endif
+
+// Time
+long long time_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// Stats
+struct stats {
+	unsigned long long count;
+	unsigned long long coalesced;
+	unsigned long long total_us;
+	unsigned long long max_us;
+	unsigned long long round_trips;
+	unsigned long long depth_total;
+	unsigned long long depth_max;
+	unsigned long long histogram[STATS_BUCKETS];
+} stats[STATS_BAR_DRAW + 1];
+unsigned long long stats_round_trips = 0;
+long long stats_started;
+
+static const char* stats_names[STATS_BAR_DRAW + 1] = {
+	[KeyPress] = "KeyPress", [KeyRelease] = "KeyRelease",
+	[ButtonPress] = "ButtonPress", [ButtonRelease] = "ButtonRelease",
+	[MotionNotify] = "MotionNotify", [EnterNotify] = "EnterNotify",
+	[LeaveNotify] = "LeaveNotify", [FocusIn] = "FocusIn",
+	[FocusOut] = "FocusOut", [KeymapNotify] = "KeymapNotify",
+	[Expose] = "Expose", [GraphicsExpose] = "GraphicsExpose",
+	[NoExpose] = "NoExpose", [VisibilityNotify] = "VisibilityNotify",
+	[CreateNotify] = "CreateNotify", [DestroyNotify] = "DestroyNotify",
+	[UnmapNotify] = "UnmapNotify", [MapNotify] = "MapNotify",
+	[MapRequest] = "MapRequest", [ReparentNotify] = "ReparentNotify",
+	[ConfigureNotify] = "ConfigureNotify", [ConfigureRequest] = "ConfigureRequest",
+	[GravityNotify] = "GravityNotify", [ResizeRequest] = "ResizeRequest",
+	[CirculateNotify] = "CirculateNotify", [CirculateRequest] = "CirculateRequest",
+	[PropertyNotify] = "PropertyNotify", [SelectionClear] = "SelectionClear",
+	[SelectionRequest] = "SelectionRequest", [SelectionNotify] = "SelectionNotify",
+	[ColormapNotify] = "ColormapNotify", [ClientMessage] = "ClientMessage",
+	[MappingNotify] = "MappingNotify", [GenericEvent] = "GenericEvent",
+	[LASTEvent] = "Extension", [STATS_BAR_DRAW] = "BarDraw",
+};
+
+struct stats* stats_slot(int type) {
+	return &stats[type >= 0 && type < LASTEvent ? type : LASTEvent];
+}
+
+// Counts a request that waits for the server, charged to the event being handled
+void stats_round_trip(void) {
+	stats_round_trips++;
+}
+
+void stats_record(struct stats* st, long long start, unsigned long long round_trips, size_t depth) {
+	unsigned long long us = time_now() - start;
+	int bucket = us > 1 ? 63 - __builtin_clzll(us) : 0;
+	if (bucket >= STATS_BUCKETS) bucket = STATS_BUCKETS - 1;
+	st->count++;
+	st->total_us += us;
+	if (us > st->max_us) st->max_us = us;
+	st->round_trips += stats_round_trips - round_trips;
+	st->depth_total += depth;
+	if (depth > st->depth_max) st->depth_max = depth;
+	st->histogram[bucket]++;
+}
+
+// Histogram bucket i counts handlers that took [2^i, 2^(i+1)) microseconds, except that bucket 0 also takes 0 and the last one everything longer
+void stats_dump(FILE* f) {
+	fprintf(f, "{\"uptime_us\":%lld,\"events\":{", time_now() - stats_started);
+	bool first = true;
+	for (int i = 0; i <= STATS_BAR_DRAW; i++) {
+		struct stats* st = &stats[i];
+		if (!(st->count || st->coalesced) || !stats_names[i])
+			continue;
+		fprintf(f, "%s\"%s\":{\"count\":%llu,\"coalesced\":%llu,\"total_us\":%llu,\"max_us\":%llu,\"round_trips\":%llu,"
+			"\"queue_depth_avg\":%.2f,\"queue_depth_max\":%llu,\"histogram_log2_us\":[",
+			first ? "" : ",", stats_names[i], st->count, st->coalesced, st->total_us, st->max_us, st->round_trips,
+			st->count ? (double) st->depth_total / st->count : 0.0, st->depth_max
+		);
+		int last = STATS_BUCKETS - 1;
+		while (last > 0 && !st->histogram[last])
+			last--;
+		for (int j = 0; j <= last; j++)
+			fprintf(f, "%s%llu", j ? "," : "", st->histogram[j]);
+		fprintf(f, "]}");
+		first = false;
+	}
+	fprintf(f, "}}\n");
+}
+
+// Files of this instance live in the user's runtime directory, named after the display
+void runtime_path(char* path, size_t size, const char* suffix) {
+	const char* dir = getenv("XDG_RUNTIME_DIR");
+	if (dir)
+		snprintf(path, size, "%s/tfwm%s%s", dir, DisplayString(display), suffix);
+	else
+		snprintf(path, size, "/tmp/tfwm-%d%s%s", getuid(), DisplayString(display), suffix);
+}
+
+// Written to a fresh private file first, so the path is never followed if it is a link
+void stats_write(void) {
+	char path[PATH_MAX], tmp[PATH_MAX + 8];
+	runtime_path(path, sizeof(path), "-stats.json");
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	int fd = mkstemp(tmp);
+	FILE* f = fd < 0 ? NULL : fdopen(fd, "w");
+	if (!f) {
+		fprintf(stderr, "tfwm: cannot write %s\n", path);
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		return;
+	}
+	stats_dump(f);
+	fclose(f);
+	if (rename(tmp, path))
+		unlink(tmp);
+}
+
+// Loop
+bool quit = false;
+bool restart = false;
+bool replaying = false;
+int loop_fd;
+struct timer* timers = NULL;
+long long timer_armed = 0;
+watch_t timer_watch;
+watch_t signal_watch;
+
+void loop_watch(watch_t* w, int fd, void (*callback)(void* data), void* data) {
+	w->fd = fd;
+	w->callback = callback;
+	w->data = data;
+	struct epoll_event event = { .events = EPOLLIN, .data.ptr = w };
+	epoll_ctl(loop_fd, EPOLL_CTL_ADD, fd, &event);
+}
+
+void loop_unwatch(watch_t* w) {
+	epoll_ctl(loop_fd, EPOLL_CTL_DEL, w->fd, NULL);
+}
+
+void timer_stop(struct timer* t) {
+	if (!t->armed) return;
+	for (struct timer** p = &timers; *p; p = &(*p)->next) {
+		if (*p != t)
+			continue;
+		*p = t->next;
+		break;
+	}
+	t->armed = false;
+}
+
+// Keeps the list sorted by deadline so only the head has to be armed
+void timer_start(struct timer* t, long long delay) {
+	timer_stop(t);
+	t->deadline = time_now() + delay;
+	t->armed = true;
+	struct timer** p = &timers;
+	while (*p && (*p)->deadline <= t->deadline)
+		p = &(*p)->next;
+	t->next = *p;
+	*p = t;
+}
+
+void timer_arm(void) {
+	long long deadline = timers ? timers->deadline : 0;
+	if (deadline == timer_armed)
+		return;
+	struct itimerspec spec = { 0 };
+	spec.it_value.tv_sec = deadline / 1000000;
+	spec.it_value.tv_nsec = deadline % 1000000 * 1000;
+	timerfd_settime(timer_watch.fd, TFD_TIMER_ABSTIME, &spec, NULL);
+	timer_armed = deadline;
+}
+
+void timer_run(void) {
+	long long now = time_now();
+	while (timers && timers->deadline <= now) {
+		struct timer* t = timers;
+		timers = t->next;
+		t->armed = false;
+		t->callback(t->data);
+	}
+}
+
+void timer_expire(void* data) {
+	(void) data;
+	uint64_t expirations;
+	if (read(timer_watch.fd, &expirations, sizeof(expirations)) < 0)
+		return;
+	timer_armed = 0;
+	timer_run();
+}
+
+void signal_read(void* data) {
+	(void) data;
+	struct signalfd_siginfo info;
+	while (read(signal_watch.fd, &info, sizeof(info)) == sizeof(info)) {
+		switch (info.ssi_signo) {
+			case SIGCHLD:
+				while (waitpid(-1, NULL, WNOHANG) > 0);
+				break;
+			case SIGINT:
+			case SIGTERM:
+				quit = true;
+				break;
+			case SIGHUP:
+				restart = quit = true;
+				break;
+			case SIGUSR1:
+				stats_write();
+				break;
+		}
+	}
+}
+
+void loop_init(void) {
+	loop_fd = epoll_create1(EPOLL_CLOEXEC);
+	loop_watch(&timer_watch, timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC), timer_expire, NULL);
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	loop_watch(&signal_watch, signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC), signal_read, NULL);
+}
+
+// Sleeps until a watched fd is readable or the earliest timer is due
+void loop_wait(void) {
+	struct epoll_event events[LOOP_MAX_EVENTS];
+	timer_arm();
+	int count = epoll_wait(loop_fd, events, LOOP_MAX_EVENTS, -1);
+	for (int i = 0; i < count; i++) {
+		watch_t* w = events[i].data.ptr;
+		if (w->callback)
+			w->callback(w->data);
+	}
+}
 
 // Atoms
 Atom _NET_ACTIVE_WINDOW;
 Atom _NET_CLIENT_LIST;
+Atom _NET_CLIENT_LIST_STACKING;
 Atom _NET_DESKTOP_GEOMETRY;
 Atom _NET_NUMBER_OF_DESKTOPS;
+Atom _NET_SUPPORTED;
+Atom _NET_SUPPORTING_WM_CHECK;
+Atom _NET_WM_BYPASS_COMPOSITOR;
+Atom _NET_WM_NAME;
 Atom _NET_WM_STATE;
 Atom _NET_WM_STATE_DEMANDS_ATTENTION;
+Atom _NET_WM_STATE_FULLSCREEN;
 Atom _NET_WM_STATE_HIDDEN;
 Atom _NET_WM_STATE_MAXIMIZED_VERT;
 Atom _NET_WM_STATE_MAXIMIZED_HORZ;
+Atom _NET_WM_SYNC_REQUEST;
+Atom _NET_WM_SYNC_REQUEST_COUNTER;
 Atom _NET_WM_WINDOW_TYPE;
 Atom _NET_WM_WINDOW_TYPE_TOOLBAR;
+Atom _TFWM_STATE;
+Atom UTF8_STRING;
 Atom WM_CHANGE_STATE;
 Atom WM_DELETE_WINDOW;
 Atom WM_PROTOCOLS;
@@ -105,25 +504,201 @@ Atom WM_STATE;
 void atom_init(void) {
 	_NET_ACTIVE_WINDOW = XInternAtom(display, "_NET_ACTIVE_WINDOW", false);
 	_NET_CLIENT_LIST = XInternAtom(display, "_NET_CLIENT_LIST", false);
+	_NET_CLIENT_LIST_STACKING = XInternAtom(display, "_NET_CLIENT_LIST_STACKING", false);
 	_NET_DESKTOP_GEOMETRY = XInternAtom(display, "_NET_DESKTOP_GEOMETRY", false);
 	_NET_NUMBER_OF_DESKTOPS = XInternAtom(display, "_NET_NUMBER_OF_DESKTOPS", false);
+	_NET_SUPPORTED = XInternAtom(display, "_NET_SUPPORTED", false);
+	_NET_SUPPORTING_WM_CHECK = XInternAtom(display, "_NET_SUPPORTING_WM_CHECK", false);
+	_NET_WM_BYPASS_COMPOSITOR = XInternAtom(display, "_NET_WM_BYPASS_COMPOSITOR", false);
+	_NET_WM_NAME = XInternAtom(display, "_NET_WM_NAME", false);
 	_NET_WM_STATE = XInternAtom(display, "_NET_WM_STATE", false);
 	_NET_WM_STATE_DEMANDS_ATTENTION = XInternAtom(display, "_NET_WM_STATE_DEMANDS_ATTENTION", false);
+	_NET_WM_STATE_FULLSCREEN = XInternAtom(display, "_NET_WM_STATE_FULLSCREEN", false);
 	_NET_WM_STATE_HIDDEN = XInternAtom(display, "_NET_WM_STATE_HIDDEN", false);
 	_NET_WM_STATE_MAXIMIZED_VERT = XInternAtom(display, "_NET_WM_STATE_MAXIMIZED_VERT", false);
 	_NET_WM_STATE_MAXIMIZED_HORZ = XInternAtom(display, "_NET_WM_STATE_MAXIMIZED_HORZ", false);
+	_NET_WM_SYNC_REQUEST = XInternAtom(display, "_NET_WM_SYNC_REQUEST", false);
+	_NET_WM_SYNC_REQUEST_COUNTER = XInternAtom(display, "_NET_WM_SYNC_REQUEST_COUNTER", false);
 	_NET_WM_WINDOW_TYPE = XInternAtom(display, "_NET_WM_WINDOW_TYPE", false);
 	_NET_WM_WINDOW_TYPE_TOOLBAR = XInternAtom(display, "_NET_WM_WINDOW_TYPE_TOOLBAR", false);
+	_TFWM_STATE = XInternAtom(display, "_TFWM_STATE", false);
+	UTF8_STRING = XInternAtom(display, "UTF8_STRING", false);
 	WM_CHANGE_STATE = XInternAtom(display, "WM_CHANGE_STATE", false);
 	WM_DELETE_WINDOW = XInternAtom(display, "WM_DELETE_WINDOW", false);
 	WM_PROTOCOLS = XInternAtom(display, "WM_PROTOCOLS", false);
 	WM_STATE = XInternAtom(display, "WM_STATE", false);
 }
 
+// Outputs
+int output_find(int x, int y) {
+	for (int i = 0; i < output_count; i++) {
+		output_t* o = &outputs[i];
+		if (x >= o->x && x < o->x + o->w && y >= o->y && y < o->y + o->h)
+			return i;
+	}
+	return -1;
+}
+
+// Points outside every output belong to the primary one
+int output_at(int x, int y) {
+	int i = output_find(x, y);
+	return i < 0 ? 0 : i;
+}
+
+output_t* output_of_bar(Window window) {
+	for (int i = 0; i < output_count; i++)
+		if (outputs[i].bar == window)
+			return &outputs[i];
+	return NULL;
+}
+
+// Fonts
+XftFont* font_chain[FONT_MAX];
+int font_count = 0;
+unsigned char* font_pages[FONT_CODEPOINTS >> 8] = { 0 };
+
+void font_init(void) {
+	xft_font = XftFontOpenName(display, DefaultScreen(display), font);
+	font_chain[0] = xft_font;
+	font_count = 1;
+}
+
+void font_cleanup(void) {
+	for (int i = 0; i < font_count; i++)
+		XftFontClose(display, font_chain[i]);
+	for (size_t i = 0; i < sizeof(font_pages) / sizeof(font_pages[0]); i++)
+		free(font_pages[i]);
+}
+
+// Asks fontconfig for a font that covers the codepoint, slow enough to only happen once per codepoint
+int font_match(FcChar32 codepoint) {
+	if (font_count == FONT_MAX)
+		return 0;
+	FcPattern* pattern = FcNameParse((const FcChar8*) font);
+	if (!pattern)
+		return 0;
+	FcCharSet* charset = FcCharSetCreate();
+	FcCharSetAddChar(charset, codepoint);
+	FcPatternAddCharSet(pattern, FC_CHARSET, charset);
+	FcCharSetDestroy(charset);
+	FcResult result;
+	FcPattern* match = XftFontMatch(display, DefaultScreen(display), pattern, &result);
+	FcPatternDestroy(pattern);
+	if (!match)
+		return 0;
+	XftFont* f = XftFontOpenPattern(display, match);
+	if (!f) {
+		FcPatternDestroy(match);
+		return 0;
+	}
+	if (!XftCharExists(display, f, codepoint)) {
+		XftFontClose(display, f);
+		return 0;
+	}
+	// Xft hands back the same font for the same match, so the chain never holds duplicates
+	for (int i = 0; i < font_count; i++) {
+		if (font_chain[i] != f)
+			continue;
+		XftFontClose(display, f);
+		return i;
+	}
+	font_chain[font_count] = f;
+	return font_count++;
+}
+
+// Gives the first font in the chain that has the codepoint, remembering the answer in 256 codepoint pages
+int font_lookup(FcChar32 codepoint) {
+	if (codepoint < 0x80 || codepoint >= FONT_CODEPOINTS)
+		return 0;
+	unsigned char** page = &font_pages[codepoint >> 8];
+	if (!*page && !(*page = calloc(256, 1)))
+		return 0;
+	unsigned char* slot = &(*page)[codepoint & 0xFF];
+	if (*slot)
+		return *slot - 1;
+	int index = 0;
+	while (index < font_count && !XftCharExists(display, font_chain[index], codepoint))
+		index++;
+	if (index == font_count)
+		index = font_match(codepoint);
+	*slot = index + 1;
+	return index;
+}
+
+// Splits UTF-8 text into runs sharing a font and measures each, runs needs room for one per byte
+int font_shape(const char* text, int length, struct text_run* runs, int* width) {
+	int count = 0;
+	for (int i = 0; i < length;) {
+		FcChar32 codepoint;
+		int size = FcUtf8ToUcs4((const FcChar8*) text + i, &codepoint, length - i);
+		int index = size > 0 ? font_lookup(codepoint) : 0;
+		if (size <= 0) size = 1;
+		if (!count || runs[count - 1].font != index)
+			runs[count++] = (struct text_run) { .font = index, .offset = i };
+		runs[count - 1].length += size;
+		i += size;
+	}
+	*width = 0;
+	for (int i = 0; i < count; i++) {
+		XGlyphInfo extents;
+		XftTextExtentsUtf8(display, font_chain[runs[i].font], (const FcChar8*) text + runs[i].offset, runs[i].length, &extents);
+		runs[i].width = extents.xOff;
+		*width += extents.xOff;
+	}
+	return count;
+}
+
+void font_draw(XftDraw* draw, const XftColor* color, int x, const char* text, const struct text_run* runs, int count) {
+	for (int i = 0; i < count; i++) {
+		XftDrawStringUtf8(draw, color, font_chain[runs[i].font],
+			x, bar_height - 6, (const FcChar8*) text + runs[i].offset, runs[i].length
+		);
+		x += runs[i].width;
+	}
+}
+
 // Bar
 char bar_status[128] = { 0 };
+int bar_open_width, bar_close_width, bar_gap_width;
 
-void bar_draw(void) {
+int bar_text_width(const char* text, int length) {
+	XGlyphInfo extents;
+	XftTextExtentsUtf8(display, xft_font, (const FcChar8*) text, length, &extents);
+	return extents.xOff;
+}
+
+void bar_init_metrics(void) {
+	bar_open_width = bar_text_width("[", 1);
+	bar_close_width = bar_text_width("]", 1);
+	bar_gap_width = bar_text_width(" ", 1);
+}
+
+void bar_measure(client_t* c) {
+	c->name_length = strlen(c->name);
+	c->name_run_count = font_shape(c->name, c->name_length, c->name_runs, &c->name_width);
+}
+
+void bar_invalidate_output(output_t* o) {
+	o->dirty = o->dirty_layout = o->layout_stale = true;
+}
+
+void bar_invalidate(void) {
+	for (int i = 0; i < output_count; i++)
+		bar_invalidate_output(&outputs[i]);
+}
+
+void bar_invalidate_client(client_t* c) {
+	if (!c) return;
+	c->bar_dirty = true;
+	outputs[c->output].dirty = true;
+}
+
+// The status text lives on the primary output's bar
+void bar_invalidate_status(void) {
+	outputs[0].dirty = outputs[0].dirty_status = true;
+}
+
+void bar_draw_client(output_t* o, client_t* c) {
 	static const XftColor normal = { .color = {
 		.alpha = 0xFFFF,
 		.red = ((colors[COLOR_TASKBAR_TEXT] >> 16) & 0xFF) * 257,
@@ -137,227 +712,2216 @@ void bar_draw(void) {
 		.blue = (colors[COLOR_TASKBAR_FOCUS] & 0xFF) * 257,
 	}};
 
-	// Clear background
 	XSetForeground(display, gc, colors[COLOR_TASKBAR]);
-	XFillRectangle(display, bar, gc, 0, 0, screen_width, bar_height);
+	XFillRectangle(display, o->pixmap, gc, c->bar_x, 0, c->bar_w, bar_height);
+
+	const XftColor *color = c == focused ? &focus : &normal;
+	int x = c->bar_x;
+	XftDrawStringUtf8(o->xft_draw, color, xft_font,
+		x, bar_height - 6, (XftChar8*) "[", 1
+	);
+	x += bar_open_width;
+	font_draw(o->xft_draw, color, x, c->name, c->name_runs, c->name_run_count);
+	x += c->name_width;
+	XftDrawStringUtf8(o->xft_draw, color, xft_font,
+		x, bar_height - 6, (XftChar8*) "]", 1
+	);
+	c->bar_dirty = false;
+}
+
+// Positions the output's client buttons from the cached title widths
+void bar_layout_update(output_t* o) {
+	if (!o->layout_stale) return;
+	int output = o - outputs;
+	size_t count = 0;
+	for (client_t* c = clients; c; c = c->next)
+		if (c->output == output)
+			count++;
+	if (count > o->layout_size) {
+		struct bar_slot* layout = realloc(o->layout, count * sizeof(*layout));
+		if (!layout) return;
+		o->layout = layout;
+		o->layout_size = count;
+	}
 
-	// Draw client buttons
 	int x = 4;
+	o->layout_count = 0;
 	for (client_t* c = clients; c; c = c->next) {
-		const XftColor *color = c == focused ? &focus : &normal;
-		XftDrawStringUtf8(xft_draw, color, xft_font,
-			x, bar_height - 6, (XftChar8*) "[", 1
-		);
-		x += xft_font->max_advance_width;
-		XftDrawStringUtf8(xft_draw, color, xft_font,
-			x, bar_height - 6, (XftChar8*) c->name, strlen(c->name)
-		);
-		x += strlen(c->name) * xft_font->max_advance_width;
-		XftDrawStringUtf8(xft_draw, color, xft_font,
-			x, bar_height - 6, (XftChar8*) "]", 1
-		);
-		x += xft_font->max_advance_width * 2;
+		if (c->output != output)
+			continue;
+		c->bar_x = x;
+		c->bar_w = bar_open_width + c->name_width + bar_close_width;
+		o->layout[o->layout_count++] = (struct bar_slot) { x, c->bar_w, c };
+		x += c->bar_w + bar_gap_width;
+	}
+	o->buttons_end = x;
+	o->layout_stale = false;
+}
+
+client_t* bar_client_at(output_t* o, int x) {
+	bar_layout_update(o);
+	size_t lo = 0, hi = o->layout_count;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (x < o->layout[mid].x + o->layout[mid].w + bar_gap_width)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo < o->layout_count ? o->layout[lo].client : NULL;
+}
+
+void bar_draw_output(output_t* o) {
+	static const XftColor status = { .color = {
+		.alpha = 0xFFFF,
+		.red = ((colors[COLOR_TASKBAR_FOCUS] >> 16) & 0xFF) * 257,
+		.green = ((colors[COLOR_TASKBAR_FOCUS] >> 8) & 0xFF) * 257,
+		.blue = (colors[COLOR_TASKBAR_FOCUS] & 0xFF) * 257,
+	}};
+
+	long long start = time_now();
+	int output = o - outputs;
+	int damage_x1 = o->w;
+	int damage_x2 = 0;
+
+	// Lay out client buttons, repainting everything if positions moved
+	if (o->dirty_layout) {
+		bar_layout_update(o);
+		for (client_t* c = clients; c; c = c->next)
+			if (c->output == output)
+				c->bar_dirty = true;
+		o->dirty_status = output == 0;
+		XSetForeground(display, gc, colors[COLOR_TASKBAR]);
+		XFillRectangle(display, o->pixmap, gc, 0, 0, o->w, bar_height);
+		damage_x1 = 0;
+		damage_x2 = o->w;
+	}
+
+	// Repaint dirty client buttons
+	for (client_t* c = clients; c; c = c->next) {
+		if (c->output != output || !c->bar_dirty)
+			continue;
+		bar_draw_client(o, c);
+		if (c->bar_x < damage_x1) damage_x1 = c->bar_x;
+		if (c->bar_x + c->bar_w > damage_x2) damage_x2 = c->bar_x + c->bar_w;
+	}
+
+	// Repaint status text, never overlapping the client buttons
+	if (o->dirty_status) {
+		struct text_run runs[sizeof(bar_status)];
+		int width;
+		int count = font_shape(bar_status, strlen(bar_status), runs, &width);
+		int x = o->w - width;
+		if (x < o->buttons_end) x = o->buttons_end;
+		int clear_x = o->dirty_layout || x < o->status_x ? x : o->status_x;
+		XSetForeground(display, gc, colors[COLOR_TASKBAR]);
+		XFillRectangle(display, o->pixmap, gc, clear_x, 0, o->w - clear_x, bar_height);
+		font_draw(o->xft_draw, &status, x, bar_status, runs, count);
+		o->status_x = x;
+		if (clear_x < damage_x1) damage_x1 = clear_x;
+		damage_x2 = o->w;
+	}
+
+	if (damage_x2 > damage_x1)
+		XCopyArea(display, o->pixmap, o->bar, gc, damage_x1, 0, damage_x2 - damage_x1, bar_height, damage_x1, 0);
+	o->dirty = o->dirty_layout = o->dirty_status = false;
+	stats_record(&stats[STATS_BAR_DRAW], start, stats_round_trips, 0);
+}
+
+// Repaints only the bars of outputs that changed, and not while a client bypassing the compositor covers them
+void bar_draw(void) {
+	bool dirty = false;
+	for (int i = 0; i < output_count; i++)
+		dirty |= outputs[i].dirty;
+	if (!dirty)
+		return;
+	bool covered[OUTPUT_MAX] = { false };
+	for (client_t* c = clients; c; c = c->next)
+		if (c->fullscreen && c->bypass == 1 && !c->hidden)
+			covered[c->output] = true;
+	for (int i = 0; i < output_count; i++)
+		if (outputs[i].dirty && !covered[i])
+			bar_draw_output(&outputs[i]);
+}
+
+// Status
+struct status {
+	bool override;
+	int stat_fd;
+	int meminfo_fd;
+	int sensor_fds[STATUS_MAX_SENSORS];
+	int sensor_count;
+	unsigned long long cpu_total;
+	unsigned long long cpu_idle;
+	struct timer timer;
+} status = { .stat_fd = -1, .meminfo_fd = -1 };
+
+ssize_t status_read(int fd, char* buffer, size_t size) {
+	ssize_t n = pread(fd, buffer, size - 1, 0);
+	buffer[n > 0 ? n : 0] = '\0';
+	return n;
+}
+
+int status_cpu(void) {
+	char buffer[256];
+	if (status_read(status.stat_fd, buffer, sizeof(buffer)) <= 0)
+		return 0;
+
+	// cpu user nice system idle iowait irq softirq steal guest guest_nice
+	unsigned long long total = 0, idle = 0;
+	char* p = buffer + 3;
+	for (int i = 0; i < 10; i++) {
+		unsigned long long value = strtoull(p, &p, 10);
+		total += value;
+		if (i == 3) idle = value;
+	}
+	unsigned long long d_total = total - status.cpu_total;
+	unsigned long long d_idle = idle - status.cpu_idle;
+	status.cpu_total = total;
+	status.cpu_idle = idle;
+	return d_total ? 100 - 100 * d_idle / d_total : 0;
+}
+
+int status_temperature(void) {
+	char buffer[32];
+	long sum = 0;
+	int count = 0;
+	for (int i = 0; i < status.sensor_count; i++) {
+		if (status_read(status.sensor_fds[i], buffer, sizeof(buffer)) <= 0)
+			continue;
+		sum += strtol(buffer, NULL, 10);
+		count++;
+	}
+	return count ? sum / count / 1000 : 0;
+}
+
+unsigned long long status_memory(void) {
+	char buffer[2048];
+	if (status_read(status.meminfo_fd, buffer, sizeof(buffer)) <= 0)
+		return 0;
+	char* total = strstr(buffer, "MemTotal:");
+	char* available = strstr(buffer, "MemAvailable:");
+	if (!total || !available)
+		return 0;
+	unsigned long long t = strtoull(total + 9, NULL, 10);
+	unsigned long long a = strtoull(available + 13, NULL, 10);
+	return (t > a ? t - a : 0) * 1024;
+}
+
+// Same output as numfmt --to iec
+void status_format_size(char* buffer, size_t size, unsigned long long bytes) {
+	static const char units[] = "KMGTP";
+	if (bytes < 1024) {
+		snprintf(buffer, size, "%llu", bytes);
+		return;
+	}
+	double value = bytes;
+	int unit = -1;
+	while (value >= 1024 && unit < (int) sizeof(units) - 2) {
+		value /= 1024;
+		unit++;
+	}
+	if (value < 10)
+		snprintf(buffer, size, "%.1f%c", value, units[unit]);
+	else
+		snprintf(buffer, size, "%.0f%c", value, units[unit]);
+}
+
+void status_update(void* data) {
+	(void) data;
+	char memory[16];
+	status_format_size(memory, sizeof(memory), status_memory());
+
+	char date_time[64];
+	time_t now = time(NULL);
+	struct tm tm;
+	strftime(date_time, sizeof(date_time), status_time_format, localtime_r(&now, &tm));
+
+	char text[sizeof(bar_status)];
+	snprintf(text, sizeof(text), "[CPU %d%% %dºC] [RAM %s] [%s]",
+		status_cpu(), status_temperature(), memory, date_time
+	);
+	if (!status.override && strcmp(text, bar_status)) {
+		strcpy(bar_status, text);
+		bar_invalidate_status();
+	}
+	timer_start(&status.timer, status_interval * 1000LL);
+}
+
+void status_set_override(bool override) {
+	status.override = override;
+	if (!status_builtin)
+		return;
+	if (override)
+		timer_stop(&status.timer);
+	else if (!status.timer.armed)
+		status_update(NULL);
+}
+
+void status_init(void) {
+	if (!status_builtin)
+		return;
+	status.stat_fd = open("/proc/stat", O_RDONLY | O_CLOEXEC);
+	status.meminfo_fd = open("/proc/meminfo", O_RDONLY | O_CLOEXEC);
+
+	DIR* hwmon = opendir("/sys/class/hwmon");
+	struct dirent* device;
+	while (hwmon && (device = readdir(hwmon))) {
+		if (device->d_name[0] == '.')
+			continue;
+		char path[512];
+		snprintf(path, sizeof(path), "/sys/class/hwmon/%s", device->d_name);
+		DIR* dir = opendir(path);
+		struct dirent* entry;
+		while (dir && (entry = readdir(dir))) {
+			size_t len = strlen(entry->d_name);
+			if (strncmp(entry->d_name, "temp", 4) || len < 6 || strcmp(entry->d_name + len - 6, "_input"))
+				continue;
+			if (status.sensor_count == STATUS_MAX_SENSORS)
+				break;
+			snprintf(path, sizeof(path), "/sys/class/hwmon/%s/%s", device->d_name, entry->d_name);
+			int fd = open(path, O_RDONLY | O_CLOEXEC);
+			if (fd >= 0)
+				status.sensor_fds[status.sensor_count++] = fd;
+		}
+		if (dir) closedir(dir);
+	}
+	if (hwmon) closedir(hwmon);
+
+	status.timer.callback = status_update;
+	status_cpu();
+	status_update(NULL);
+}
+
+// Properties
+bool props_dirty = true;
+bool props_dirty_client_list = true;
+bool props_dirty_active = true;
+Window* props_client_list = NULL;
+size_t props_client_list_count = 0;
+size_t props_client_list_size = 0;
+Window props_active_written = None;
+
+void props_flush_state(client_t* c) {
+	enum { STATE_HIDDEN = 1 << 0, STATE_MAXIMIZED = 1 << 1, STATE_FULLSCREEN = 1 << 2 };
+	Atom atoms[4];
+	int count = 0;
+	int mask = 0;
+	if (c->hidden) {
+		atoms[count++] = _NET_WM_STATE_HIDDEN;
+		mask |= STATE_HIDDEN;
+	}
+	if (c->anchor == ANCHOR_TOP) {
+		atoms[count++] = _NET_WM_STATE_MAXIMIZED_VERT;
+		atoms[count++] = _NET_WM_STATE_MAXIMIZED_HORZ;
+		mask |= STATE_MAXIMIZED;
+	}
+	if (c->fullscreen) {
+		atoms[count++] = _NET_WM_STATE_FULLSCREEN;
+		mask |= STATE_FULLSCREEN;
+	}
+	if (mask != c->net_state_written) {
+		XChangeProperty(display, c->window, _NET_WM_STATE, XA_ATOM, 32, PropModeReplace, (unsigned char*) atoms, count);
+		c->net_state_written = mask;
+	}
+
+	long state = c->hidden ? IconicState : NormalState;
+	if (state != c->wm_state_written) {
+		XChangeProperty(display, c->window, WM_STATE, WM_STATE, 32, PropModeReplace, (unsigned char*) &state, 1);
+		c->wm_state_written = state;
+	}
+	c->state_dirty = false;
+}
+
+void props_flush_client_list(void) {
+	size_t count = 0;
+	for (client_t* c = clients; c; c = c->next)
+		count++;
+	if (count > props_client_list_size) {
+		Window* list = realloc(props_client_list, count * sizeof(*list));
+		if (!list) return;
+		props_client_list = list;
+		props_client_list_size = count;
+	}
+
+	// The clients list is newest first, EWMH wants initial mapping order
+	bool changed = count != props_client_list_count;
+	size_t i = count;
+	for (client_t* c = clients; c; c = c->next) {
+		if (props_client_list[--i] != c->window) {
+			props_client_list[i] = c->window;
+			changed = true;
+		}
+	}
+	props_client_list_count = count;
+	if (changed)
+		XChangeProperty(display, root, _NET_CLIENT_LIST, XA_WINDOW, 32, PropModeReplace, (unsigned char*) props_client_list, count);
+}
+
+void props_flush(void) {
+	if (!props_dirty) return;
+	for (client_t* c = clients; c; c = c->next)
+		if (c->state_dirty)
+			props_flush_state(c);
+	if (props_dirty_client_list)
+		props_flush_client_list();
+	if (props_dirty_active) {
+		Window active = focused ? focused->window : None;
+		if (active != props_active_written) {
+			XChangeProperty(display, root, _NET_ACTIVE_WINDOW, XA_WINDOW, 32, PropModeReplace, (unsigned char*) &active, 1);
+			props_active_written = active;
+		}
+	}
+	props_dirty = props_dirty_client_list = props_dirty_active = false;
+}
+
+void props_invalidate_client_list(void) {
+	props_dirty = props_dirty_client_list = true;
+}
+
+void props_invalidate_active(void) {
+	props_dirty = props_dirty_active = true;
+}
+
+// Titles
+// Copies text into a fixed buffer, ending it with "..." on a character boundary if it does not fit
+void title_truncate(const char* text, size_t length, char* buffer, size_t size) {
+	if (length < size) {
+		memcpy(buffer, text, length);
+		buffer[length] = '\0';
+		return;
+	}
+	size_t cut = size - 4;
+	while (cut > 0 && (text[cut] & 0xC0) == 0x80)
+		cut--;
+	memcpy(buffer, text, cut);
+	strcpy(buffer + cut, "...");
+}
+
+char* title_arena = NULL;
+size_t title_arena_used = 0;
+size_t title_arena_size = 0;
+size_t title_arena_garbage = 0;
+
+const char* title_get(client_t* c) {
+	return title_arena ? title_arena + c->title_offset : "";
+}
+
+// Packs every live title to the front once most of the arena is stale
+void title_compact(void) {
+	char* arena = malloc(title_arena_size);
+	if (!arena) return;
+	size_t used = 0;
+	for (int i = 0; i < CLIENT_HASH_SIZE; i++) {
+		for (client_t* c = client_table[i]; c; c = c->hash_next) {
+			memcpy(arena + used, title_arena + c->title_offset, c->title_length);
+			c->title_offset = used;
+			c->title_capacity = c->title_length;
+			used += c->title_length;
+		}
+	}
+	free(title_arena);
+	title_arena = arena;
+	title_arena_used = used;
+	title_arena_garbage = 0;
+}
+
+void title_release(client_t* c) {
+	title_arena_garbage += c->title_capacity;
+	c->title_capacity = c->title_length = 0;
+}
+
+// Stores the full title in place when it fits, returning whether it changed
+bool title_store(client_t* c, const char* text, size_t length) {
+	if ((int) length == c->title_length && !memcmp(title_get(c), text, length))
+		return false;
+	if ((int) length > c->title_capacity) {
+		title_release(c);
+		if (title_arena_garbage > title_arena_used / 2)
+			title_compact();
+		if (title_arena_used + length > title_arena_size) {
+			size_t size = title_arena_size ? title_arena_size : 4096;
+			while (title_arena_used + length > size)
+				size *= 2;
+			// The old slot is released, so the client must not keep pointing at it
+			char* arena = realloc(title_arena, size);
+			if (!arena) {
+				c->title_offset = 0;
+				c->title_length = 0;
+				return false;
+			}
+			title_arena = arena;
+			title_arena_size = size;
+		}
+		c->title_offset = title_arena_used;
+		c->title_capacity = length;
+		title_arena_used += length;
+	}
+	memcpy(title_arena + c->title_offset, text, length);
+	c->title_length = length;
+	return true;
+}
+
+// Repaints the bar only when the shortened text it shows is different
+void title_set(client_t* c, const char* text, size_t length) {
+	if (!title_store(c, text, length))
+		return;
+	char name[sizeof(c->name)];
+	title_truncate(text, length, name, sizeof(name));
+	if (!strcmp(name, c->name))
+		return;
+	int width = c->name_width;
+	strcpy(c->name, name);
+	bar_measure(c);
+	if (c->name_width != width)
+		bar_invalidate_output(&outputs[c->output]);
+	else
+		bar_invalidate_client(c);
+}
+
+void request_title(Window window);
+
+void title_fetch(void* data) {
+	client_t* c = data;
+	c->title_next = time_now() + 1000000 / title_rate;
+	request_title(c->window);
+}
+
+// Fetches the title now, or once the window's rate limit allows it
+void title_refresh(client_t* c) {
+	if (c->title_timer.armed)
+		return;
+	long long now = time_now();
+	if (now >= c->title_next) {
+		title_fetch(c);
+		return;
+	}
+	c->title_timer.callback = title_fetch;
+	c->title_timer.data = c;
+	timer_start(&c->title_timer, c->title_next - now);
+}
+
+// Stack
+client_t** stack = NULL;
+size_t stack_count = 0;
+size_t stack_size = 0;
+bool stack_dirty = false;
+bool stack_full = false;
+Window* stack_windows = NULL;
+size_t stack_windows_size = 0;
+
+size_t stack_index(client_t* c) {
+	size_t i = 0;
+	while (i < stack_count && stack[i] != c)
+		i++;
+	return i;
+}
+
+void stack_remove(client_t* c) {
+	size_t i = stack_index(c);
+	if (i == stack_count) return;
+	memmove(&stack[i], &stack[i + 1], (stack_count - i - 1) * sizeof(*stack));
+	stack_count--;
+	stack_dirty = true;
+}
+
+// Puts the client above every other one, adding it if it is new
+void stack_raise(client_t* c) {
+	if (stack_count && stack[stack_count - 1] == c) return;
+	stack_remove(c);
+	if (stack_count == stack_size) {
+		size_t size = stack_size ? stack_size * 2 : 64;
+		client_t** grown = realloc(stack, size * sizeof(*grown));
+		if (!grown) return;
+		stack = grown;
+		stack_size = size;
+	}
+	stack[stack_count++] = c;
+	c->stack_moved = stack_dirty = true;
+}
+
+void stack_lower(client_t* c) {
+	size_t i = stack_index(c);
+	if (i == stack_count || i == 0) return;
+	memmove(&stack[1], &stack[0], i * sizeof(*stack));
+	stack[0] = c;
+	c->stack_moved = stack_dirty = true;
+}
+
+// Puts the client right above or below a sibling, as ConfigureRequests naming one ask
+void stack_place(client_t* c, client_t* sibling, bool above) {
+	if (c == sibling || stack_index(c) == stack_count || stack_index(sibling) == stack_count)
+		return;
+	stack_remove(c);
+	size_t i = stack_index(sibling) + (above ? 1 : 0);
+	memmove(&stack[i + 1], &stack[i], (stack_count - i) * sizeof(*stack));
+	stack[i] = c;
+	stack_count++;
+	c->stack_moved = stack_dirty = true;
+}
+
+// Whether a shown client above or below this one overlaps it, only the sibling counts when there is one
+bool stack_occluded(client_t* c, client_t* sibling, bool above) {
+	size_t i = stack_index(c);
+	for (size_t j = 0; j < stack_count; j++) {
+		client_t* o = stack[j];
+		if (j == i || (above ? j < i : j > i) || (sibling && o != sibling) || o->hidden)
+			continue;
+		if (o->x < c->x + c->w + 2*border_width && c->x < o->x + o->w + 2*border_width
+			&& o->y < c->y + c->h + 2*border_width && c->y < o->y + o->h + 2*border_width)
+			return true;
 	}
+	return false;
+}
+
+// New bars need the whole order applied again
+void stack_invalidate(void) {
+	stack_dirty = stack_full = true;
+}
+
+// Places each moved client right below its upper neighbour, going top down so that one is already in place
+void stack_flush_moved(void) {
+	for (size_t i = stack_count; i-- > 0;) {
+		client_t* c = stack[i];
+		if (!c->stack_moved)
+			continue;
+		c->stack_moved = false;
+		if (i == stack_count - 1) {
+			XRaiseWindow(display, c->window);
+			continue;
+		}
+		XWindowChanges changes = { .sibling = stack[i + 1]->window, .stack_mode = Below };
+		XConfigureWindow(display, c->window, CWSibling | CWStackMode, &changes);
+	}
+}
+
+// Restacks only the clients that moved, every window when the bars changed, and publishes the order
+void stack_flush(void) {
+	if (!stack_dirty) return;
+	size_t count = stack_count + output_count;
+	if (count > stack_windows_size) {
+		Window* windows = realloc(stack_windows, count * sizeof(*windows));
+		if (!windows) return;
+		stack_windows = windows;
+		stack_windows_size = count;
+	}
+
+	// XRestackWindows goes top to bottom, sending one request per window, EWMH wants bottom to top
+	if (stack_full) {
+		size_t n = 0;
+		for (size_t i = stack_count; i-- > 0;) {
+			stack[i]->stack_moved = false;
+			stack_windows[n++] = stack[i]->window;
+		}
+		for (int i = 0; i < output_count; i++)
+			stack_windows[n++] = outputs[i].bar;
+		XRestackWindows(display, stack_windows, n);
+		stack_full = false;
+	} else {
+		stack_flush_moved();
+	}
+	for (size_t i = 0; i < stack_count; i++)
+		stack_windows[i] = stack[i]->window;
+	XChangeProperty(display, root, _NET_CLIENT_LIST_STACKING, XA_WINDOW, 32, PropModeReplace, (unsigned char*) stack_windows, stack_count);
+	stack_dirty = false;
+}
+
+// Client
+client_t* client_alloc(void) {
+	if (!client_pool) {
+		client_t* chunk = calloc(CLIENT_POOL_CHUNK, sizeof(*chunk));
+		if (!chunk) return NULL;
+		for (int i = 0; i < CLIENT_POOL_CHUNK; i++) {
+			chunk[i].next = client_pool;
+			client_pool = &chunk[i];
+		}
+	}
+	client_t* c = client_pool;
+	client_pool = c->next;
+	memset(c, 0, sizeof(*c));
+	return c;
+}
+
+void client_free(client_t* c) {
+	c->next = client_pool;
+	client_pool = c;
+}
+
+size_t client_hash(Window window) {
+	return (window ^ (window >> 8) ^ (window >> 16)) & (CLIENT_HASH_SIZE - 1);
+}
+
+void client_index_add(client_t* c) {
+	client_t** bucket = &client_table[client_hash(c->window)];
+	c->hash_next = *bucket;
+	*bucket = c;
+}
+
+void client_index_remove(client_t* c) {
+	for (client_t** p = &client_table[client_hash(c->window)]; *p; p = &(*p)->hash_next) {
+		if (*p != c)
+			continue;
+		*p = c->hash_next;
+		break;
+	}
+}
+
+client_t* client_find(Window window) {
+	for (client_t* c = client_table[client_hash(window)]; c; c = c->hash_next)
+		if (c->window == window)
+			return c;
+	return NULL;
+}
+
+bool client_any_visible(void) {
+	for (client_t *c = clients; c; c = c->next)
+		if (!c->hidden)
+			return true;
+	return false;
+}
+
+// Replayed windows are stand-ins owned by tfwm, killing their client would kill tfwm
+void client_close(client_t* c) {
+	if (replaying)
+		return;
+	if (c->delete_window) {
+		XEvent event;
+		event.type = ClientMessage;
+		event.xclient.window = c->window;
+		event.xclient.message_type = WM_PROTOCOLS;
+		event.xclient.format = 32;
+		event.xclient.data.l[0] = WM_DELETE_WINDOW;
+		event.xclient.data.l[1] = CurrentTime;
+		XSendEvent(display, c->window, false, NoEventMask, &event);
+		return;
+	}
+
+	XGrabServer(display);
+	XSetCloseDownMode(display, DestroyAll);
+	XKillClient(display, c->window);
+	XSync(display, false);
+	stats_round_trip();
+	XUngrabServer(display);
+}
+
+// Snaps a size to the client's resize increments and keeps it within its limits
+void client_constrain(client_t* c, int* w, int* h) {
+	if (c->max_w && *w > c->max_w) *w = c->max_w;
+	if (c->max_h && *h > c->max_h) *h = c->max_h;
+	if (c->inc_w > 1 && *w > c->base_w)
+		*w = c->base_w + (*w - c->base_w) / c->inc_w * c->inc_w;
+	if (c->inc_h > 1 && *h > c->base_h)
+		*h = c->base_h + (*h - c->base_h) / c->inc_h * c->inc_h;
+	if (*w < c->min_w) *w = c->min_w;
+	if (*h < c->min_h) *h = c->min_h;
+	if (*w < 1) *w = 1;
+	if (*h < 1) *h = 1;
+}
+
+void client_set_output(client_t* c, int output) {
+	if (c->output == output) return;
+	bar_invalidate_output(&outputs[c->output]);
+	bar_invalidate_output(&outputs[output]);
+	c->output = output;
+}
+
+// Moves the client's bar button to the output holding its centre
+void client_update_output(client_t* c) {
+	client_set_output(c, output_at(c->x + c->w / 2, c->y + c->h / 2));
+}
+
+void client_move(client_t* c, int x, int y) {
+	XMoveWindow(display, c->window, x, y);
+	c->x = x;
+	c->y = y;
+	client_update_output(c);
+}
+
+void client_resize(client_t *c, int w, int h) {
+	XResizeWindow(display, c->window, w, h);
+	c->w = w;
+	c->h = h;
+	client_update_output(c);
+}
+
+void client_move_resize(client_t* c, int x, int y, int w, int h) {
+	XMoveResizeWindow(display, c->window, x, y, w, h);
+	c->x = x;
+	c->y = y;
+	c->w = w;
+	c->h = h;
+	client_update_output(c);
+}
+
+void request_bypass(Window window);
+
+void client_update_state(client_t* c) {
+	c->state_dirty = true;
+	props_dirty = true;
+}
+
+// Covers the client's whole output, above its bar and without a border
+void client_fullscreen_apply(client_t* c) {
+	output_t* o = &outputs[c->output];
+	XSetWindowBorderWidth(display, c->window, 0);
+	client_move_resize(c, o->x, o->y, o->w, o->h);
+	stack_raise(c);
+}
+
+void client_fullscreen(client_t* c, bool fullscreen) {
+	if (c->fullscreen == fullscreen) return;
+	c->fullscreen = fullscreen;
+	if (fullscreen) {
+		c->fx = c->x;
+		c->fy = c->y;
+		c->fw = c->w;
+		c->fh = c->h;
+		client_fullscreen_apply(c);
+		request_bypass(c->window);
+	} else {
+		XSetWindowBorderWidth(display, c->window, border_width);
+		client_move_resize(c, c->fx, c->fy, c->fw, c->fh);
+	}
+	client_update_state(c);
+}
+
+// Fits the client to its anchor on the output it belongs to
+void anchor_geometry(output_t* o, anchor_t anchor, int* x, int* y, int* w, int* h) {
+	int view_height = o->h - bar_height;
+	int top = o->y + bar_height;
+	int left = o->x - border_width;
+	int middle = o->x + o->w / 2;
+	switch (anchor) {
+		case ANCHOR_NONE: break;
+		case ANCHOR_TOP: *x = left, *y = top, *w = o->w + 2*border_width, *h = view_height + 2*border_width; break;
+		case ANCHOR_TOP_LEFT: *x = left, *y = top, *w = o->w / 2, *h = view_height / 2; break;
+		case ANCHOR_TOP_RIGHT: *x = middle, *y = top, *w = o->w / 2, *h = view_height / 2; break;
+		case ANCHOR_LEFT: *x = left, *y = top, *w = o->w / 2, *h = view_height; break;
+		case ANCHOR_RIGHT: *x = middle, *y = top, *w = o->w / 2, *h = view_height; break;
+		case ANCHOR_BOT_LEFT: *x = left, *y = top + view_height / 2, *w = o->w / 2, *h = view_height / 2; break;
+		case ANCHOR_BOT_RIGHT: *x = middle, *y = top + view_height / 2, *w = o->w / 2, *h = view_height / 2; break;
+	}
+}
+
+void client_anchor_apply(client_t* c) {
+	int x = c->px, y = c->py, w = c->pw, h = c->ph;
+	anchor_geometry(&outputs[c->output], c->anchor, &x, &y, &w, &h);
+	client_move_resize(c, x, y, w, h);
+}
+
+void client_anchor(client_t* c, anchor_t anchor) {
+	client_fullscreen(c, false);
+	if (c->anchor == anchor) return;
+	if (c->anchor == ANCHOR_NONE) {
+		c->px = c->x;
+		c->py = c->y;
+		c->pw = c->w;
+		c->ph = c->h;
+	}
+	c->anchor = anchor;
+	client_anchor_apply(c);
+	client_update_state(c);
+}
+
+void client_focus(client_t* c) {
+	timer_stop(&focus_timer);
+	if (c == focused)
+		return;
+	if (focused)
+		XSetWindowBorder(display, focused->window, colors[COLOR_BORDER]);
+	if (c)
+		XSetWindowBorder(display, c->window, colors[COLOR_BORDER_FOCUS]);
+	bar_invalidate_client(focused);
+	bar_invalidate_client(c);
+	focused = c;
+	XSetInputFocus(display, c ? c->window : root, RevertToPointerRoot, CurrentTime);
+	props_invalidate_active();
+}
+
+// Unmaps the window so it stops drawing, the UnmapNotify this causes is ours
+void client_hide(client_t* c) {
+	if (c->hidden) return;
+	c->hidden = true;
+	c->ignore_unmaps++;
+	XUnmapWindow(display, c->window);
+	client_update_state(c);
+	if (focus_timer.data == c)
+		timer_stop(&focus_timer);
+	if (c == focused)
+		client_focus(NULL);
+}
+
+void client_show(client_t* c) {
+	if (!c->hidden) return;
+	c->hidden = false;
+	XMoveResizeWindow(display, c->window, c->x, c->y, c->w, c->h);
+	XMapWindow(display, c->window);
+	client_update_state(c);
+}
+
+void client_lower(client_t* c) {
+	stack_lower(c);
+}
+
+void client_raise(client_t* c) {
+	if (c->hidden) client_show(c);
+	stack_raise(c);
+	client_focus(c);
+}
+
+// Manages a window that was already there, keeping its geometry and saved state
+void client_adopt(client_t* c, int x, int y, int w, int h) {
+	client_t** p = &clients;
+	while (*p && (*p)->order <= c->order)
+		p = &(*p)->next;
+	c->pending = false;
+	c->next = *p;
+	*p = c;
+	stack_raise(c);
+	c->x = x;
+	c->y = y;
+	c->w = w;
+	c->h = h;
+	c->output = output_at(x + w / 2, y + h / 2);
+	if (c->fullscreen) {
+		client_fullscreen_apply(c);
+		request_bypass(c->window);
+	} else if (c->anchor != ANCHOR_NONE) {
+		client_anchor_apply(c);
+	}
+	bar_invalidate_output(&outputs[c->output]);
+
+	XAddToSaveSet(display, c->window);
+	props_invalidate_client_list();
+	XConfigureWindow(display, c->window, CWBorderWidth, &(XWindowChanges){.border_width=c->fullscreen ? 0 : border_width});
+	XSetWindowBorder(display, c->window, colors[c->restore_focus ? COLOR_BORDER_FOCUS : COLOR_BORDER]);
+	client_update_state(c);
+	if (c->restore_focus && !c->hidden)
+		client_focus(c);
+}
+
+void client_manage(client_t* c, int ax, int ay, int aw, int ah) {
+	if (c->order) {
+		client_adopt(c, ax, ay, aw, ah);
+		return;
+	}
+
+	// Fullscreen requested before mapping applies once the window is placed
+	bool fullscreen = c->fullscreen;
+	c->fullscreen = false;
+
+	// Windows without a position open on the focused window's output
+	c->output = ax > 0 && ay > 0 ? output_at(ax, ay) : focused ? focused->output : 0;
+	output_t* o = &outputs[c->output];
+	int view_height = o->h - bar_height;
+
+	// A minimum larger than the output would open the window off screen
+	if (c->min_w > o->w) c->min_w = o->w;
+	if (c->min_h > view_height) c->min_h = view_height;
+
+	int w;
+	if (aw > o->w) w = o->w;
+	else if (aw < 16) w = o->w * 3 / 4;
+	else w = aw;
+
+	int h;
+	if (ah > view_height) h = view_height;
+	else if (ah < 16) h = (view_height) * 3 / 4;
+	else h = ah;
+	client_constrain(c, &w, &h);
+
+	int x;
+	if (ax <= 0) x = o->x + (o->w - w) / 2;
+	else x = ax;
+
+	int y;
+	if (ay <= 0) y = o->y + (view_height - h) / 2 + bar_height;
+	else if (ay < o->y + bar_height) y = o->y + bar_height;
+	else y = ay;
+
+	c->pending = false;
+	c->next = clients;
+	clients = c;
+	stack_raise(c);
+	client_move_resize(c, x, y, w, h);
+	bar_invalidate_output(&outputs[c->output]);
+
+	XAddToSaveSet(display, c->window);
+	props_invalidate_client_list();
+	XConfigureWindow(display, c->window, CWBorderWidth, &(XWindowChanges){.border_width=border_width});
+	XSetWindowBorder(display, c->window, colors[COLOR_BORDER_FOCUS]);
+	c->hidden = false;
+	client_update_state(c);
+	XMapWindow(display, c->window);
+	if (fullscreen)
+		client_fullscreen(c, true);
+}
+
+void drag_outline_hide(void);
+
+client_t* client_create(Window window) {
+	client_t* c = client_alloc();
+	if (!c) return NULL;
+	c->window = window;
+	c->anchor = ANCHOR_NONE;
+	c->pending = true;
+	c->hidden = true;
+	c->net_state_written = -1;
+	c->wm_state_written = -1;
+	client_index_add(c);
+	return c;
+}
+
+void client_remove(client_t* c) {
+	for (client_t** p = &clients; *p; p = &(*p)->next) {
+		if (*p != c)
+			continue;
+		*p = c->next;
+		props_invalidate_client_list();
+		bar_invalidate_output(&outputs[c->output]);
+		break;
+	}
+	if (c == focused) {
+		focused = NULL;
+		props_invalidate_active();
+	}
+	if (focus_timer.data == c)
+		timer_stop(&focus_timer);
+	if (c == drag.client) {
+		drag_outline_hide();
+		drag.client = NULL;
+		timer_stop(&drag.timer);
+	}
+	stack_remove(c);
+	timer_stop(&c->title_timer);
+	title_release(c);
+	client_index_remove(c);
+	client_free(c);
+}
+
+// Window
+// Gives the property as UTF-8, a returned list must be freed with XFreeStringList
+const char* window_text(xcb_get_property_reply_t* reply, size_t* length, char*** list) {
+	*list = NULL;
+	if (reply->type == XCB_NONE)
+		return NULL;
+	const char* value = xcb_get_property_value(reply);
+	*length = xcb_get_property_value_length(reply);
+	if (reply->type == UTF8_STRING)
+		return value;
+
+	XTextProperty prop = {
+		.value = (unsigned char*) value,
+		.encoding = reply->type,
+		.format = reply->format,
+		.nitems = reply->value_len,
+	};
+	int count = 0;
+	int ret = Xutf8TextPropertyToTextList(display, &prop, list, &count);
+	if (ret < Success || count < 1 || !(*list)[0])
+		return NULL;
+	*length = strlen((*list)[0]);
+	return (*list)[0];
+}
+
+// Requests
+typedef enum request_type {
+	REQUEST_ATTRIBUTES,
+	REQUEST_BYPASS,
+	REQUEST_CLASS,
+	REQUEST_GEOMETRY,
+	REQUEST_HINTS,
+	REQUEST_NET_NAME,
+	REQUEST_NET_STATE,
+	REQUEST_PROTOCOLS,
+	REQUEST_STATE,
+	REQUEST_SYNC_COUNTER,
+	REQUEST_TITLE,
+} request_type_t;
+
+enum {
+	STATE_ORDER,
+	STATE_FLAGS,
+	STATE_ANCHOR,
+	STATE_PX, STATE_PY, STATE_PW, STATE_PH,
+	STATE_FX, STATE_FY, STATE_FW, STATE_FH,
+	STATE_LENGTH,
+};
+enum { STATE_FLAG_HIDDEN = 1 << 0, STATE_FLAG_FOCUSED = 1 << 1, STATE_FLAG_FULLSCREEN = 1 << 2 };
+
+struct request {
+	request_type_t type;
+	Window window;
+	unsigned int sequence;
+} request_queue[REQUEST_QUEUE_SIZE];
+size_t request_head = 0;
+size_t request_count = 0;
+
+void request_sync_counter(Window window);
+
+// Size hints are CARD32 but read as signed by most clients, anything outside what X can size is unset
+int hints_size(uint32_t value) {
+	return (int32_t) value > 0 && value <= 32767 ? (int) value : 0;
+}
+
+void request_handle(struct request* r, void* reply) {
+	if (r->type == REQUEST_TITLE && r->window == root) {
+		if (!reply) return;
+		bool override = xcb_get_property_value_length(reply) > 0;
+		size_t length;
+		char** list;
+		const char* text = override ? window_text(reply, &length, &list) : NULL;
+		if (text) {
+			title_truncate(text, length, bar_status, sizeof(bar_status));
+			bar_invalidate_status();
+		}
+		if (list)
+			XFreeStringList(list);
+		status_set_override(override);
+		return;
+	}
+
+	client_t* c = client_find(r->window);
+	if (!c) return;
+	switch (r->type) {
+		case REQUEST_ATTRIBUTES: {
+			// Adopt managed-looking windows, hidden ones only if we hid them
+			xcb_get_window_attributes_reply_t* attributes = reply;
+			if (!attributes || attributes->override_redirect || (attributes->map_state != XCB_MAP_STATE_VIEWABLE && !c->hidden))
+				client_remove(c);
+			else
+				XSelectInput(display, c->window, EnterWindowMask | PropertyChangeMask);
+			break;
+		}
+		case REQUEST_STATE: {
+			if (!reply || xcb_get_property_value_length(reply) < STATE_LENGTH * 4) break;
+			uint32_t* state = xcb_get_property_value(reply);
+			c->order = state[STATE_ORDER] + 1;
+			c->hidden = state[STATE_FLAGS] & STATE_FLAG_HIDDEN;
+			c->restore_focus = state[STATE_FLAGS] & STATE_FLAG_FOCUSED;
+			if (state[STATE_ANCHOR] <= ANCHOR_BOT_RIGHT)
+				c->anchor = state[STATE_ANCHOR];
+			c->px = (int32_t) state[STATE_PX];
+			c->py = (int32_t) state[STATE_PY];
+			c->pw = state[STATE_PW];
+			c->ph = state[STATE_PH];
+			c->fullscreen = state[STATE_FLAGS] & STATE_FLAG_FULLSCREEN;
+			c->fx = (int32_t) state[STATE_FX];
+			c->fy = (int32_t) state[STATE_FY];
+			c->fw = state[STATE_FW];
+			c->fh = state[STATE_FH];
+			XDeleteProperty(display, c->window, _TFWM_STATE);
+			break;
+		}
+		case REQUEST_BYPASS: {
+			// The hint is the client's to set and the compositor's to act on, tfwm only reads it
+			c->bypass = reply && xcb_get_property_value_length(reply) >= 4 ? *(uint32_t*) xcb_get_property_value(reply) : 0;
+			break;
+		}
+		case REQUEST_HINTS: {
+			// WM_SIZE_HINTS: flags, x, y, w, h, min, max, inc, aspect, base, gravity
+			c->base_w = c->base_h = c->min_w = c->min_h = 0;
+			c->max_w = c->max_h = c->inc_w = c->inc_h = 0;
+			if (!reply || xcb_get_property_value_length(reply) < 15 * 4) break;
+			uint32_t* hints = xcb_get_property_value(reply);
+			bool has_base = (hints[0] & PBaseSize) && xcb_get_property_value_length(reply) >= 17 * 4;
+			if (hints[0] & PMinSize) {
+				c->min_w = hints_size(hints[5]);
+				c->min_h = hints_size(hints[6]);
+			}
+			if (hints[0] & PMaxSize) {
+				c->max_w = hints_size(hints[7]);
+				c->max_h = hints_size(hints[8]);
+			}
+			if (hints[0] & PResizeInc) {
+				c->inc_w = hints_size(hints[9]);
+				c->inc_h = hints_size(hints[10]);
+			}
+			if (has_base) {
+				c->base_w = hints_size(hints[15]);
+				c->base_h = hints_size(hints[16]);
+			}
+
+			// Per ICCCM the base size falls back to the minimum and the other way around
+			if (!has_base) {
+				c->base_w = c->min_w;
+				c->base_h = c->min_h;
+			} else if (!(hints[0] & PMinSize)) {
+				c->min_w = c->base_w;
+				c->min_h = c->base_h;
+			}
+			if (c->max_w && c->min_w > c->max_w) c->min_w = c->max_w;
+			if (c->max_h && c->min_h > c->max_h) c->min_h = c->max_h;
+			break;
+		}
+		case REQUEST_NET_STATE: {
+			if (!reply || !c->pending) break;
+			xcb_atom_t* atoms = xcb_get_property_value(reply);
+			int count = xcb_get_property_value_length(reply) / sizeof(*atoms);
+			for (int i = 0; i < count; i++)
+				if (atoms[i] == _NET_WM_STATE_FULLSCREEN && !c->order)
+					c->fullscreen = true;
+			break;
+		}
+		case REQUEST_GEOMETRY: {
+			xcb_get_geometry_reply_t* geometry = reply;
+			if (!geometry) client_remove(c);
+			else if (c->pending) client_manage(c, geometry->x, geometry->y, geometry->width, geometry->height);
+			break;
+		}
+		case REQUEST_PROTOCOLS: {
+			c->delete_window = false;
+			c->sync_counter = None;
+			if (!reply) break;
+			xcb_atom_t* atoms = xcb_get_property_value(reply);
+			int count = xcb_get_property_value_length(reply) / sizeof(*atoms);
+			for (int i = 0; i < count; i++) {
+				if (atoms[i] == WM_DELETE_WINDOW)
+					c->delete_window = true;
+				else if (atoms[i] == _NET_WM_SYNC_REQUEST && sync_supported)
+					request_sync_counter(c->window);
+			}
+			break;
+		}
+		case REQUEST_SYNC_COUNTER: {
+			if (!reply || xcb_get_property_value_length(reply) < 4) break;
+			c->sync_counter = *(uint32_t*) xcb_get_property_value(reply);
+			break;
+		}
+		case REQUEST_CLASS: {
+			// WM_CLASS holds the instance and then the class, each NUL terminated
+			if (!reply) break;
+			const char* value = xcb_get_property_value(reply);
+			int length = xcb_get_property_value_length(reply);
+			for (int i = 0; i < length;) {
+				size_t n = strnlen(value + i, length - i);
+				for (const char** class = wireframe_classes; *class; class++)
+					if (strlen(*class) == n && !memcmp(value + i, *class, n))
+						c->wireframe = true;
+				i += n + 1;
+			}
+			break;
+		}
+		case REQUEST_NET_NAME:
+		case REQUEST_TITLE: {
+			// _NET_WM_NAME is asked for first and wins over WM_NAME when set
+			if (r->type == REQUEST_NET_NAME)
+				c->net_name = reply && xcb_get_property_value_length(reply) > 0;
+			else if (c->net_name)
+				break;
+			if (!reply) break;
+			size_t length;
+			char** list;
+			const char* text = window_text(reply, &length, &list);
+			if (text)
+				title_set(c, text, length);
+			if (list)
+				XFreeStringList(list);
+			break;
+		}
+	}
+}
+
+void request_push(request_type_t type, Window window, unsigned int sequence) {
+	// Out of room, so wait for the oldest reply to free a slot
+	if (request_count == REQUEST_QUEUE_SIZE) {
+		struct request* r = &request_queue[request_head];
+		xcb_generic_error_t* error = NULL;
+		void* reply = xcb_wait_for_reply(connection, r->sequence, &error);
+		stats_round_trip();
+		request_head = (request_head + 1) % REQUEST_QUEUE_SIZE;
+		request_count--;
+		request_handle(r, reply);
+		free(reply);
+		free(error);
+	}
+	struct request* r = &request_queue[(request_head + request_count) % REQUEST_QUEUE_SIZE];
+	r->type = type;
+	r->window = window;
+	r->sequence = sequence;
+	request_count++;
+}
+
+void request_attributes(Window window) {
+	request_push(REQUEST_ATTRIBUTES, window, xcb_get_window_attributes(connection, window).sequence);
+}
+
+void request_bypass(Window window) {
+	request_push(REQUEST_BYPASS, window, xcb_get_property(connection, false, window, _NET_WM_BYPASS_COMPOSITOR, XA_CARDINAL, 0, 1).sequence);
+}
+
+void request_class(Window window) {
+	request_push(REQUEST_CLASS, window, xcb_get_property(connection, false, window, XA_WM_CLASS, XA_STRING, 0, 64).sequence);
+}
+
+void request_geometry(Window window) {
+	request_push(REQUEST_GEOMETRY, window, xcb_get_geometry(connection, window).sequence);
+}
+
+void request_hints(Window window) {
+	request_push(REQUEST_HINTS, window, xcb_get_property(connection, false, window, XA_WM_NORMAL_HINTS, XA_WM_SIZE_HINTS, 0, 18).sequence);
+}
+
+void request_net_state(Window window) {
+	request_push(REQUEST_NET_STATE, window, xcb_get_property(connection, false, window, _NET_WM_STATE, XA_ATOM, 0, 32).sequence);
+}
+
+void request_protocols(Window window) {
+	request_push(REQUEST_PROTOCOLS, window, xcb_get_property(connection, false, window, WM_PROTOCOLS, XA_ATOM, 0, 32).sequence);
+}
+
+void request_state(Window window) {
+	request_push(REQUEST_STATE, window, xcb_get_property(connection, false, window, _TFWM_STATE, XA_CARDINAL, 0, STATE_LENGTH).sequence);
+}
+
+void request_sync_counter(Window window) {
+	request_push(REQUEST_SYNC_COUNTER, window, xcb_get_property(connection, false, window, _NET_WM_SYNC_REQUEST_COUNTER, XA_CARDINAL, 0, 1).sequence);
+}
+
+// Clients are asked for both names at full length, the root only for its WM_NAME status
+void request_title(Window window) {
+	if (window != root)
+		request_push(REQUEST_NET_NAME, window, xcb_get_property(connection, false, window, _NET_WM_NAME, UTF8_STRING, 0, UINT16_MAX).sequence);
+	request_push(REQUEST_TITLE, window, xcb_get_property(connection, false, window, XA_WM_NAME, XCB_GET_PROPERTY_TYPE_ANY, 0, UINT16_MAX).sequence);
+}
+
+void request_flush(void) {
+	if (request_count)
+		xcb_flush(connection);
+}
+
+bool request_collect(void) {
+	bool handled = false;
+	while (request_count) {
+		struct request* r = &request_queue[request_head];
+		void* reply = NULL;
+		xcb_generic_error_t* error = NULL;
+		if (!xcb_poll_for_reply(connection, r->sequence, &reply, &error))
+			break;
+		request_head = (request_head + 1) % REQUEST_QUEUE_SIZE;
+		request_count--;
+		request_handle(r, reply);
+		free(reply);
+		free(error);
+		handled = true;
+	}
+	if (xcb_connection_has_error(connection)) {
+		fprintf(stderr, "tfwm: lost request connection\n");
+		exit(EXIT_FAILURE);
+	}
+	return handled;
+}
+
+// Session
+// Manages every window mapped before tfwm started with one round trip for the tree
+void session_adopt(void) {
+	Window root_return, parent_return;
+	Window* children;
+	unsigned int count;
+	if (!XQueryTree(display, root, &root_return, &parent_return, &children, &count))
+		return;
+	stats_round_trip();
+	for (unsigned int i = 0; i < count; i++) {
+		if (output_of_bar(children[i]) || client_find(children[i]))
+			continue;
+		client_t* c = client_create(children[i]);
+		if (!c) break;
+		c->order = INT_MAX;
+		c->hidden = false;
+		request_state(c->window);
+		request_attributes(c->window);
+		request_title(c->window);
+		request_protocols(c->window);
+		request_hints(c->window);
+		request_class(c->window);
+		request_geometry(c->window);
+	}
+	if (children)
+		XFree(children);
+}
+
+// Leaves each client's state on its window for the next instance to pick up
+void session_save(void) {
+	int order = 0;
+	for (client_t* c = clients; c; c = c->next) {
+		uint32_t state[STATE_LENGTH];
+		state[STATE_ORDER] = order++;
+		state[STATE_FLAGS] = (c->hidden ? STATE_FLAG_HIDDEN : 0) | (c == focused ? STATE_FLAG_FOCUSED : 0) | (c->fullscreen ? STATE_FLAG_FULLSCREEN : 0);
+		state[STATE_ANCHOR] = c->anchor;
+		state[STATE_PX] = c->px;
+		state[STATE_PY] = c->py;
+		state[STATE_PW] = c->pw;
+		state[STATE_PH] = c->ph;
+		state[STATE_FX] = c->fx;
+		state[STATE_FY] = c->fy;
+		state[STATE_FW] = c->fw;
+		state[STATE_FH] = c->fh;
+		long data[STATE_LENGTH];
+		for (int i = 0; i < STATE_LENGTH; i++)
+			data[i] = state[i];
+		XChangeProperty(display, c->window, _TFWM_STATE, XA_CARDINAL, 32, PropModeReplace, (unsigned char*) data, STATE_LENGTH);
+
+		// The save set would map hidden windows when this connection closes
+		if (c->hidden)
+			XRemoveFromSaveSet(display, c->window);
+	}
+	XSync(display, false);
+	stats_round_trip();
+}
+
+// Drag
+void drag_sync_request(client_t* c) {
+	XSyncValue value;
+	c->sync_value++;
+	XSyncIntsToValue(&value, c->sync_value & 0xFFFFFFFF, c->sync_value >> 32);
+
+	XEvent event = { 0 };
+	event.type = ClientMessage;
+	event.xclient.window = c->window;
+	event.xclient.message_type = WM_PROTOCOLS;
+	event.xclient.format = 32;
+	event.xclient.data.l[0] = _NET_WM_SYNC_REQUEST;
+	event.xclient.data.l[1] = drag.time;
+	event.xclient.data.l[2] = XSyncValueLow32(value);
+	event.xclient.data.l[3] = XSyncValueHigh32(value);
+	XSendEvent(display, c->window, false, NoEventMask, &event);
+
+	// Get notified once the client has painted the new size
+	XSyncAlarmAttributes attr;
+	attr.trigger.counter = c->sync_counter;
+	attr.trigger.value_type = XSyncAbsolute;
+	attr.trigger.wait_value = value;
+	attr.trigger.test_type = XSyncPositiveComparison;
+	XSyncIntToValue(&attr.delta, 0);
+	attr.events = true;
+	unsigned long mask = XSyncCACounter | XSyncCAValueType | XSyncCAValue | XSyncCATestType | XSyncCADelta | XSyncCAEvents;
+	if (drag.alarm == None)
+		drag.alarm = XSyncCreateAlarm(display, mask, &attr);
+	else
+		XSyncChangeAlarm(display, drag.alarm, mask, &attr);
+	drag.sync_sent = time_now();
+}
+
+bool drag_sync_waiting(void) {
+	return drag.sync_sent && time_now() - drag.sync_sent < drag_sync_timeout * 1000LL;
+}
+
+// Only edges with no neighbouring output behind them anchor
+anchor_t drag_edge(int mx, int my, int* output) {
+	*output = output_at(mx, my);
+	output_t* o = &outputs[*output];
+	bool left = mx == o->x && output_find(mx - 1, my) < 0;
+	bool right = mx == o->x + o->w - 1 && output_find(mx + 1, my) < 0;
+	bool top = my == o->y && output_find(mx, my - 1) < 0;
+	bool bottom = my == o->y + o->h - 1 && output_find(mx, my + 1) < 0;
+	if (top && left) return ANCHOR_TOP_LEFT;
+	if (top && right) return ANCHOR_TOP_RIGHT;
+	if (bottom && left) return ANCHOR_BOT_LEFT;
+	if (bottom && right) return ANCHOR_BOT_RIGHT;
+	if (top) return ANCHOR_TOP;
+	if (left) return ANCHOR_LEFT;
+	if (right) return ANCHOR_RIGHT;
+	return ANCHOR_NONE;
+}
+
+void drag_size(client_t* c, int* width, int* height) {
+	if (*width < 64) *width = 64;
+	if (*height < 32) *height = 32;
+	client_constrain(c, width, height);
+}
+
+// Outlines are four thin override-redirect windows, so repaints under them never leave traces
+Window drag_frames[4] = { None };
+
+void drag_outline_hide(void) {
+	if (!drag.outline_drawn)
+		return;
+	for (int i = 0; i < 4; i++)
+		XUnmapWindow(display, drag_frames[i]);
+	drag.outline_drawn = false;
+}
+
+void drag_outline(int x, int y, int w, int h) {
+	if (drag.outline_drawn && x == drag.ox && y == drag.oy && w == drag.ow && h == drag.oh)
+		return;
+	if (drag_frames[0] == None) {
+		XSetWindowAttributes attributes = { .override_redirect = true, .background_pixel = colors[COLOR_TASKBAR_FOCUS] };
+		for (int i = 0; i < 4; i++)
+			drag_frames[i] = XCreateWindow(display, root, 0, 0, 1, 1, 0, CopyFromParent, InputOutput, CopyFromParent, CWOverrideRedirect | CWBackPixel, &attributes);
+	}
+	drag.ox = x;
+	drag.oy = y;
+	drag.ow = w;
+	drag.oh = h;
+
+	// Top, bottom, left and right edges around the client's border
+	const int t = 2;
+	int fw = w + 2*border_width;
+	int fh = h + 2*border_width;
+	int side = fh - 2*t > 0 ? fh - 2*t : 1;
+	XMoveResizeWindow(display, drag_frames[0], x, y, fw, t);
+	XMoveResizeWindow(display, drag_frames[1], x, y + fh - t, fw, t);
+	XMoveResizeWindow(display, drag_frames[2], x, y + t, t, side);
+	XMoveResizeWindow(display, drag_frames[3], x + fw - t, y + t, t, side);
+	if (!drag.outline_drawn) {
+		for (int i = 0; i < 4; i++)
+			XMapRaised(display, drag_frames[i]);
+		drag.outline_drawn = true;
+	}
+}
+
+// Shows where the client would go, including anchor targets, without touching it
+void drag_outline_update(void) {
+	client_t* c = drag.client;
+	int mx = drag.mx;
+	int my = drag.my;
+	int x = c->x, y = c->y, w = c->w, h = c->h;
+	drag.outline_anchor = ANCHOR_NONE;
+	if (drag.button == 1) {
+		drag.outline_anchor = drag_edge(mx, my, &drag.outline_output);
+		if (drag.outline_anchor != ANCHOR_NONE) {
+			anchor_geometry(&outputs[drag.outline_output], drag.outline_anchor, &x, &y, &w, &h);
+		} else if (c->anchor != ANCHOR_NONE) {
+			w = c->pw;
+			h = c->ph;
+			x = mx - w / 2;
+			y = my - h / 2;
+		} else {
+			x = drag.x + mx - drag.start_x;
+			y = drag.y + my - drag.start_y;
+		}
+	} else if (drag.button == 3 && c->anchor == ANCHOR_NONE) {
+		w = drag.w + mx - drag.start_x;
+		h = drag.h + my - drag.start_y;
+		drag_size(c, &w, &h);
+	}
+	drag_outline(x, y, w, h);
+}
+
+// Moves or resizes the client once, to where the outline was left
+void drag_outline_commit(void) {
+	client_t* c = drag.client;
+	if (!drag.outline_drawn)
+		return;
+	drag_outline_hide();
+	if (drag.outline_anchor != ANCHOR_NONE) {
+		client_set_output(c, drag.outline_output);
+		if (c->anchor == drag.outline_anchor)
+			client_anchor_apply(c);
+		else
+			client_anchor(c, drag.outline_anchor);
+	} else if (drag.button == 1) {
+		// Leaving an anchor goes straight to the dropped geometry instead of restoring the old one first
+		if (c->anchor != ANCHOR_NONE) {
+			c->anchor = ANCHOR_NONE;
+			client_update_state(c);
+		}
+		client_move_resize(c, drag.ox, drag.oy, drag.ow, drag.oh);
+	} else if (drag.ow != c->w || drag.oh != c->h) {
+		client_resize(c, drag.ow, drag.oh);
+	}
+}
+
+void drag_apply(void) {
+	client_t* c = drag.client;
+	int mx = drag.mx;
+	int my = drag.my;
+	drag.pending = false;
+	drag.next_frame = time_now() + 1000000 / drag_frame_rate;
+
+	if (drag.outline) {
+		drag_outline_update();
+		return;
+	}
+
+	if (drag.button == 1) {
+		int output;
+		anchor_t anchor = drag_edge(mx, my, &output);
+		if (anchor != ANCHOR_NONE) {
+			if (c->anchor == anchor && c->output == output)
+				return;
+			client_set_output(c, output);
+			if (c->anchor == anchor)
+				client_anchor_apply(c);
+			else
+				client_anchor(c, anchor);
+		} else {
+			if (c->anchor != ANCHOR_NONE) {
+				client_anchor(c, ANCHOR_NONE);
+				drag.x = drag.start_x - c->w / 2;
+				drag.y = drag.start_y - c->h / 2;
+			}
+			client_move(c, drag.x + mx - drag.start_x, drag.y + my - drag.start_y);
+		}
+	} else if (drag.button == 3 && c->anchor == ANCHOR_NONE) {
+		int width = drag.w + mx - drag.start_x;
+		int height = drag.h + my - drag.start_y;
+		drag_size(c, &width, &height);
+		if (width == c->w && height == c->h)
+			return;
+		if (c->sync_counter != None)
+			drag_sync_request(c);
+		client_resize(c, width, height);
+	}
+}
+
+// Applies pending motion once the next frame is due and the client caught up
+void drag_update(void) {
+	if (!drag.client || !drag.pending)
+		return;
+	long long now = time_now();
+	long long due = drag.next_frame;
+	if (drag_sync_waiting() && drag.sync_sent + drag_sync_timeout * 1000LL > due)
+		due = drag.sync_sent + drag_sync_timeout * 1000LL;
+	if (now < due)
+		timer_start(&drag.timer, due - now);
+	else
+		drag_apply();
+}
+
+void drag_frame(void* data) {
+	(void) data;
+	drag_update();
+}
+
+void drag_begin(client_t* c, XButtonEvent* e) {
+	drag.client = c;
+	drag.button = e->button;
+	drag.start_x = e->x_root;
+	drag.start_y = e->y_root;
+	drag.x = c->x;
+	drag.y = c->y;
+	drag.w = c->w;
+	drag.h = c->h;
+	drag.time = e->time;
+	drag.pending = false;
+	drag.next_frame = 0;
+	drag.sync_sent = 0;
+	drag.timer.callback = drag_frame;
+	drag.outline = (e->state & wireframe_mask) || c->wireframe;
+	drag.outline_drawn = false;
+}
+
+void drag_motion(XMotionEvent* e) {
+	drag.mx = e->x_root;
+	drag.my = e->y_root;
+	drag.time = e->time;
+	drag.pending = true;
+}
+
+void drag_end(void) {
+	if (!drag.client)
+		return;
+	if (drag.pending)
+		drag_apply();
+	if (drag.outline)
+		drag_outline_commit();
+	if (drag.alarm != None)
+		XSyncDestroyAlarm(display, drag.alarm);
+	drag.alarm = None;
+	drag.client = NULL;
+	timer_stop(&drag.timer);
+}
+
+// Spawn
+extern char** environ;
+
+posix_spawnattr_t spawn_attr;
+
+// Children start in their own session with tfwm's blocked signals restored
+void spawn_init(void) {
+	sigset_t mask, defaults;
+	sigemptyset(&mask);
+	sigemptyset(&defaults);
+	sigaddset(&defaults, SIGCHLD);
+	sigaddset(&defaults, SIGHUP);
+	sigaddset(&defaults, SIGINT);
+	sigaddset(&defaults, SIGTERM);
+	sigaddset(&defaults, SIGUSR1);
+	posix_spawnattr_init(&spawn_attr);
+	posix_spawnattr_setflags(&spawn_attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+	posix_spawnattr_setsigmask(&spawn_attr, &mask);
+	posix_spawnattr_setsigdefault(&spawn_attr, &defaults);
+}
+
+// Splits a command into argv once, going through the shell only when it needs one
+bool spawn_parse(const char* command, char** argv) {
+	int argc = 0;
+	if (!strpbrk(command, "|&;<>()$`\\\"'*?[]#~=%{}!\n")) {
+		char* buffer = strdup(command);
+		if (!buffer) return false;
+		char* rest;
+		char* arg = strtok_r(buffer, " \t", &rest);
+		for (; arg && argc < SPAWN_MAX_ARGS - 1; arg = strtok_r(NULL, " \t", &rest))
+			argv[argc++] = arg;
+		argv[argc] = NULL;
+		if (argc && !arg)
+			return true;
+
+		// Too many words for argv go through the shell instead of being cut off
+		free(buffer);
+		if (!argc) return false;
+		argc = 0;
+	}
+	argv[argc++] = "/bin/sh";
+	argv[argc++] = "-c";
+	argv[argc++] = (char*) command;
+	argv[argc] = NULL;
+	return true;
+}
+
+// Runs a command without forking tfwm itself
+void spawn(char** argv) {
+	if (replaying)
+		return;
+	pid_t pid;
+	int error = posix_spawnp(&pid, argv[0], NULL, &spawn_attr, argv, environ);
+	if (error)
+		fprintf(stderr, "tfwm: cannot run %s: %s\n", argv[0], strerror(error));
+}
+
+// Keys
+struct key_binding {
+	KeyCode keycode;
+	unsigned int mask;
+	void (*action)(XKeyEvent* e, char** argv);
+	char* argv[SPAWN_MAX_ARGS];
+	bool resolved;
+	struct key_binding* next;
+} key_bindings[sizeof(shortcuts) / sizeof(shortcuts[0])];
+struct key_binding* key_table[256];
+unsigned int lock_mods[] = { 0, LockMask, 0, LockMask };
+
+void action_spawn(XKeyEvent* e, char** argv) {
+	(void) e;
+	spawn(argv);
+}
+
+void action_change(XKeyEvent* e, char** argv) {
+	(void) e, (void) argv;
+	client_t* c = focused ? focused : clients;
+	if (c) client_raise(c->next ? c->next : clients);
+}
+
+void action_close(XKeyEvent* e, char** argv) {
+	(void) argv;
+	client_t* c = client_find(e->subwindow);
+	if (c) client_close(c);
+}
+
+void action_hide(XKeyEvent* e, char** argv) {
+	(void) argv;
+	client_t* c = client_find(e->subwindow);
+	if (c) client_hide(c);
+}
+
+void action_lower(XKeyEvent* e, char** argv) {
+	(void) argv;
+	client_t* c = client_find(e->subwindow);
+	if (c) client_lower(c);
+}
+
+void action_quit(XKeyEvent* e, char** argv) {
+	(void) e, (void) argv;
+	if (!replaying)
+		quit = true;
+}
+
+void action_restart(XKeyEvent* e, char** argv) {
+	(void) e, (void) argv;
+	if (!replaying)
+		restart = quit = true;
+}
+
+const struct {
+	const char* name;
+	void (*action)(XKeyEvent* e, char** argv);
+} key_actions[] = {
+	{ "!change", action_change },
+	{ "!close", action_close },
+	{ "!hide", action_hide },
+	{ "!lower", action_lower },
+	{ "!quit", action_quit },
+	{ "!restart", action_restart },
+};
+
+void keys_grab(struct key_binding* b, bool grab) {
+	if (!b->keycode) return;
+	for (int i = 0; i < 4; i++) {
+		if (grab)
+			XGrabKey(display, b->keycode, lock_mods[i] | b->mask, root, true, GrabModeAsync, GrabModeAsync);
+		else
+			XUngrabKey(display, b->keycode, lock_mods[i] | b->mask, root);
+	}
+}
+
+// Resolves every shortcut to a keycode and action, regrabbing only keys that moved
+void keys_compile(void) {
+	memset(key_table, 0, sizeof(key_table));
+	for (size_t i = 0; i < shortcut_count; i++) {
+		struct key_binding* b = &key_bindings[i];
+		if (!b->resolved) {
+			const char* command = shortcuts[i].command;
+			b->resolved = true;
+			b->mask = shortcuts[i].mask;
+			for (size_t j = 0; j < sizeof(key_actions) / sizeof(key_actions[0]); j++)
+				if (!strcmp(command, key_actions[j].name))
+					b->action = key_actions[j].action;
+			if (!b->action && command[0] == '!')
+				fprintf(stderr, "tfwm: unknown command %s\n", command);
+			else if (!b->action && spawn_parse(command, b->argv))
+				b->action = action_spawn;
+		}
+
+		KeyCode keycode = b->action ? XKeysymToKeycode(display, shortcuts[i].key) : 0;
+		if (keycode != b->keycode) {
+			keys_grab(b, false);
+			b->keycode = keycode;
+			keys_grab(b, true);
+		}
+		if (keycode) {
+			b->next = key_table[keycode];
+			key_table[keycode] = b;
+		}
+	}
+}
+
+// Grabs buttons and keys under every combination of the lock modifiers
+void input_grab(void) {
+	unsigned int numlock = 0;
+	KeyCode numlock_keycode = XKeysymToKeycode(display, XK_Num_Lock);
+	XModifierKeymap* mk = XGetModifierMapping(display);
+	stats_round_trip();
+	for (int i = 0; i < 8; i++) {
+		int kpm = mk->max_keypermod;
+		for (int j = 0; j < kpm; j++)
+			if (numlock_keycode && mk->modifiermap[i * kpm + j] == numlock_keycode)
+				numlock |= 1 << i;
+	}
+	XFreeModifiermap(mk);
+	lock_mods[2] = numlock;
+	lock_mods[3] = numlock | LockMask;
+
+	for (int i = 0; i < output_count; i++)
+		XUngrabButton(display, AnyButton, AnyModifier, outputs[i].bar);
+	XUngrabButton(display, AnyButton, AnyModifier, root);
+	XUngrabKey(display, AnyKey, AnyModifier, root);
+	for (int i = 0; i < 4; i++) {
+		for (int j = 0; j < output_count; j++) {
+			XGrabButton(display, 1, lock_mods[i], outputs[j].bar, true, ButtonPressMask, GrabModeAsync, GrabModeAsync, None, None);
+			XGrabButton(display, 3, lock_mods[i], outputs[j].bar, true, ButtonPressMask, GrabModeAsync, GrabModeAsync, None, None);
+		}
+		XGrabButton(display, 1, lock_mods[i] | Mod4Mask, root, true, ButtonPressMask, GrabModeAsync, GrabModeAsync, None, None);
+		XGrabButton(display, 3, lock_mods[i] | Mod4Mask, root, true, ButtonPressMask, GrabModeAsync, GrabModeAsync, None, None);
+		XGrabButton(display, 1, lock_mods[i] | Mod4Mask | wireframe_mask, root, true, ButtonPressMask, GrabModeAsync, GrabModeAsync, None, None);
+		XGrabButton(display, 3, lock_mods[i] | Mod4Mask | wireframe_mask, root, true, ButtonPressMask, GrabModeAsync, GrabModeAsync, None, None);
+	}
+	for (size_t i = 0; i < shortcut_count; i++)
+		key_bindings[i].keycode = 0;
+	keys_compile();
+}
+
+// Screen
+bool screen_stale = false;
+
+void screen_create_bar(output_t* o) {
+	int screen = DefaultScreen(display);
+	o->bar = XCreateSimpleWindow(display, root, o->x, o->y, o->w, bar_height - border_width, 0, 0, 0);
+	XChangeProperty(display, o->bar, _NET_WM_WINDOW_TYPE, XA_ATOM, 32, PropModeReplace, (unsigned char*) &_NET_WM_WINDOW_TYPE_TOOLBAR, 1);
+	XSelectInput(display, o->bar, ExposureMask | ButtonPressMask);
+	XConfigureWindow(display, o->bar, CWBorderWidth, &(XWindowChanges){.border_width=border_width});
+	XSetWindowBorder(display, o->bar, colors[COLOR_BORDER_FOCUS]);
+	XSetWindowBackgroundPixmap(display, o->bar, None);
+	XMapWindow(display, o->bar);
+	o->pixmap = XCreatePixmap(display, o->bar, o->w, bar_height, DefaultDepth(display, screen));
+	o->xft_draw = XftDrawCreate(display, o->pixmap, DefaultVisual(display, screen), DefaultColormap(display, screen));
+}
+
+void screen_destroy_bar(output_t* o) {
+	XftDrawDestroy(o->xft_draw);
+	XFreePixmap(display, o->pixmap);
+	XDestroyWindow(display, o->bar);
+}
+
+// Rebuilds the output table, recreating only the bars whose geometry changed
+void screen_update(void) {
+	XRectangle found[OUTPUT_MAX];
+	int count = 0;
+	screen_width = DisplayWidth(display, DefaultScreen(display));
+	screen_height = DisplayHeight(display, DefaultScreen(display));
+#ifdef XRANDR
+	if (xrandr_supported) {
+		int monitor_count;
+		XRRMonitorInfo* monitors = XRRGetMonitors(display, root, true, &monitor_count);
+		stats_round_trip();
+		for (int i = 0; i < monitor_count && count < OUTPUT_MAX; i++) {
+			// Keep the primary output first, it carries the status text
+			XRectangle r = { monitors[i].x, monitors[i].y, monitors[i].width, monitors[i].height };
+			if (monitors[i].primary && count) {
+				found[count] = found[0];
+				found[0] = r;
+			} else {
+				found[count] = r;
+			}
+			count++;
+		}
+		if (monitors)
+			XRRFreeMonitors(monitors);
+	}
+#endif
+	if (!count)
+		found[count++] = (XRectangle) { 0, 0, screen_width, screen_height };
+
+	for (int i = 0; i < count; i++) {
+		output_t* o = &outputs[i];
+		if (i < output_count && o->x == found[i].x && o->y == found[i].y && o->w == found[i].width && o->h == found[i].height)
+			continue;
+		if (i < output_count)
+			screen_destroy_bar(o);
+		o->x = found[i].x;
+		o->y = found[i].y;
+		o->w = found[i].width;
+		o->h = found[i].height;
+		screen_create_bar(o);
+	}
+	for (int i = count; i < output_count; i++)
+		screen_destroy_bar(&outputs[i]);
+	output_count = count;
+
+	// Refit anchored clients and rescue the ones left outside every output
+	for (client_t* c = clients; c; c = c->next) {
+		if (c->output >= count)
+			c->output = 0;
+		if (c->fullscreen) {
+			client_fullscreen_apply(c);
+		} else if (c->anchor != ANCHOR_NONE) {
+			client_anchor_apply(c);
+		} else if (output_find(c->x + c->w / 2, c->y + c->h / 2) < 0) {
+			output_t* o = &outputs[c->output];
+			client_move(c, o->x + (o->w - c->w) / 2, o->y + (o->h - bar_height - c->h) / 2 + bar_height);
+		} else {
+			client_update_output(c);
+		}
+	}
+	bar_invalidate();
+	stack_invalidate();
+
+	XChangeProperty(display, root, _NET_DESKTOP_GEOMETRY, XA_CARDINAL, 32, PropModeReplace, (unsigned char*) &screen_width, 1);
+	XChangeProperty(display, root, _NET_DESKTOP_GEOMETRY, XA_CARDINAL, 32, PropModeAppend, (unsigned char*) &screen_height, 1);
+}
+
+void screen_flush(void) {
+	if (!screen_stale) return;
+	screen_stale = false;
+	screen_update();
+	input_grab();
+}
+
+// IPC
+typedef struct ipc_connection {
+	watch_t watch;
+	char in[IPC_BUFFER_SIZE];
+	size_t in_length;
+	FILE* out;
+	char* out_buffer;
+	size_t out_length;
+} ipc_connection_t;
+
+static const char* anchor_names[] = {
+	[ANCHOR_NONE] = "none", [ANCHOR_TOP] = "top",
+	[ANCHOR_TOP_LEFT] = "top-left", [ANCHOR_TOP_RIGHT] = "top-right",
+	[ANCHOR_LEFT] = "left", [ANCHOR_RIGHT] = "right",
+	[ANCHOR_BOT_LEFT] = "bottom-left", [ANCHOR_BOT_RIGHT] = "bottom-right",
+};
 
-	// Draw status text
-	XftDrawStringUtf8(xft_draw, &focus, xft_font,
-		screen_width - strlen(bar_status) * xft_font->max_advance_width, bar_height - 6,
-		(XftChar8*) bar_status, strlen(bar_status)
-	);
-}
+char ipc_path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+watch_t ipc_watch = { .fd = -1 };
 
-// Client
-client_t* client_find(Window window) {
-	for (client_t* c = clients; c; c = c->next)
-		if (c->window == window)
-			return c;
-	return NULL;
+client_t* ipc_client(const char* arg) {
+	if (!arg) return NULL;
+	if (!strcmp(arg, "focused")) return focused;
+	client_t* c = client_find(strtoul(arg, NULL, 0));
+	return c && !c->pending ? c : NULL;
 }
 
-bool client_any_visible(void) {
-	for (client_t *c = clients; c; c = c->next)
-		if (!c->hidden)
-			return true;
-	return false;
-}
+// Runs one command line, answering with optional data lines and then "ok" or "error ..."
+void ipc_command(FILE* out, char* line) {
+	char* rest;
+	char* command = strtok_r(line, " \t", &rest);
+	if (!command)
+		return;
 
-void client_close(client_t* c) {
-	Atom* protocols;
-	int protocol_count;
-	if (XGetWMProtocols(display, c->window, &protocols, &protocol_count)) {
-		for (int i = 0; i < protocol_count; i++) {
-			if (protocols[i] != WM_DELETE_WINDOW)
-				continue;
-			XEvent event;
-			event.type = ClientMessage;
-			event.xclient.window = c->window;
-			event.xclient.message_type = WM_PROTOCOLS;
-			event.xclient.format = 32;
-			event.xclient.data.l[0] = WM_DELETE_WINDOW;
-			event.xclient.data.l[1] = CurrentTime;
-			XSendEvent(display, c->window, false, NoEventMask, &event);
-			XFree(protocols);
+	if (!strcmp(command, "clients")) {
+		for (client_t* c = clients; c; c = c->next) {
+			// Titles are shortened and kept on one line so they cannot pose as reply lines
+			char title[ipc_title_max + 1];
+			title_truncate(title_get(c), c->title_length, title, sizeof(title));
+			for (char* p = title; *p; p++)
+				if ((unsigned char) *p < 0x20 || *p == 0x7f)
+					*p = ' ';
+			fprintf(out, "client 0x%lx %d %d %d %d %s %s %s %s\n", c->window, c->x, c->y, c->w, c->h,
+				c == focused ? "focused" : "-", c->hidden ? "hidden" : "shown", anchor_names[c->anchor], title
+			);
+		}
+	} else if (!strcmp(command, "stats")) {
+		stats_dump(out);
+	} else if (!strcmp(command, "status")) {
+		while (*rest == ' ' || *rest == '\t')
+			rest++;
+		if (*rest) {
+			snprintf(bar_status, sizeof(bar_status), "%s", rest);
+			bar_invalidate_status();
+		}
+		status_set_override(*rest);
+	} else {
+		client_t* c = ipc_client(strtok_r(NULL, " \t", &rest));
+		if (!c) {
+			fprintf(out, "error no such client\n");
+			return;
+		}
+		if (!strcmp(command, "raise")) {
+			client_raise(c);
+		} else if (!strcmp(command, "hide")) {
+			client_hide(c);
+		} else if (!strcmp(command, "anchor")) {
+			char* name = strtok_r(NULL, " \t", &rest);
+			size_t i = 0;
+			while (name && i < sizeof(anchor_names) / sizeof(anchor_names[0]) && strcmp(name, anchor_names[i]))
+				i++;
+			if (!name || i == sizeof(anchor_names) / sizeof(anchor_names[0])) {
+				fprintf(out, "error unknown anchor\n");
+				return;
+			}
+			client_anchor(c, i);
+		} else if (!strcmp(command, "move-resize")) {
+			int x, y, w, h;
+			if (sscanf(rest, "%d %d %d %d", &x, &y, &w, &h) != 4 || w <= 0 || h <= 0) {
+				fprintf(out, "error expected x y width height\n");
+				return;
+			}
+			client_fullscreen(c, false);
+			if (c->anchor != ANCHOR_NONE) {
+				c->anchor = ANCHOR_NONE;
+				client_update_state(c);
+			}
+			client_move_resize(c, x, y, w, h);
+		} else {
+			fprintf(out, "error unknown command\n");
 			return;
 		}
-		XFree(protocols);
 	}
-
-	XGrabServer(display);
-	XSetCloseDownMode(display, DestroyAll);
-	XKillClient(display, c->window);
-	XSync(display, false);
-	XUngrabServer(display);
+	fprintf(out, "ok\n");
 }
 
-void client_move(client_t* c, int x, int y) {
-	XMoveWindow(display, c->window, x, y);
-	c->x = x;
-	c->y = y;
+void ipc_close(ipc_connection_t* conn) {
+	loop_unwatch(&conn->watch);
+	close(conn->watch.fd);
+	fclose(conn->out);
+	free(conn->out_buffer);
+	free(conn);
 }
 
-void client_resize(client_t *c, int w, int h) {
-	XResizeWindow(display, c->window, w, h);
-	c->w = w;
-	c->h = h;
+// Replies are small, a client that does not read them is dropped
+bool ipc_reply(ipc_connection_t* conn) {
+	fflush(conn->out);
+	if (!conn->out_length)
+		return true;
+	ssize_t written = write(conn->watch.fd, conn->out_buffer, conn->out_length);
+	rewind(conn->out);
+	return written == (ssize_t) conn->out_length;
 }
 
-void client_move_resize(client_t* c, int x, int y, int w, int h) {
-	XMoveResizeWindow(display, c->window, x, y, w, h);
-	c->x = x;
-	c->y = y;
-	c->w = w;
-	c->h = h;
+// Runs every complete line received so far; the batch is flushed to X once afterwards
+void ipc_read(void* data) {
+	ipc_connection_t* conn = data;
+	ssize_t n = read(conn->watch.fd, conn->in + conn->in_length, sizeof(conn->in) - conn->in_length - 1);
+	if (n <= 0) {
+		if (n < 0 && errno == EAGAIN) return;
+
+		// A last command without a newline still runs when the peer stops writing
+		if (n == 0 && conn->in_length) {
+			conn->in[conn->in_length] = '\0';
+			ipc_command(conn->out, conn->in);
+			ipc_reply(conn);
+		}
+		ipc_close(conn);
+		return;
+	}
+	conn->in_length += n;
+	conn->in[conn->in_length] = '\0';
+
+	char* line = conn->in;
+	char* end;
+	while ((end = strchr(line, '\n'))) {
+		*end = '\0';
+		ipc_command(conn->out, line);
+		line = end + 1;
+	}
+	conn->in_length -= line - conn->in;
+	memmove(conn->in, line, conn->in_length);
+	if (conn->in_length == sizeof(conn->in) - 1) {
+		ipc_close(conn);
+		return;
+	}
+
+	if (!ipc_reply(conn))
+		ipc_close(conn);
 }
 
-void client_update_state(client_t* c) {
-	XDeleteProperty(display, c->window, _NET_WM_STATE);
-	if (c->hidden)
-		XChangeProperty(display, c->window, _NET_WM_STATE, XA_ATOM, 32, PropModeAppend, (unsigned char*) &_NET_WM_STATE_HIDDEN, 1);
-	if (c->anchor == ANCHOR_TOP) {
-		XChangeProperty(display, c->window, _NET_WM_STATE, XA_ATOM, 32, PropModeAppend, (unsigned char*) &_NET_WM_STATE_MAXIMIZED_VERT, 1);
-		XChangeProperty(display, c->window, _NET_WM_STATE, XA_ATOM, 32, PropModeAppend, (unsigned char*) &_NET_WM_STATE_MAXIMIZED_HORZ, 1);
+void ipc_accept(void* data) {
+	(void) data;
+	int fd = accept4(ipc_watch.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) return;
+	ipc_connection_t* conn = calloc(1, sizeof(*conn));
+	if (conn)
+		conn->out = open_memstream(&conn->out_buffer, &conn->out_length);
+	if (!conn || !conn->out) {
+		free(conn);
+		close(fd);
+		return;
 	}
-
-	long state = c->hidden ? IconicState : NormalState;
-	XChangeProperty(display, c->window, WM_STATE, WM_STATE, 32, PropModeReplace, (unsigned char*) &state, 1);
+	loop_watch(&conn->watch, fd, ipc_read, conn);
 }
 
-void client_hide(client_t* c) {
-	if (c->hidden) return;
-	c->hidden = true;
-	XMoveWindow(display, c->window, -2 * c->w, c->y);
-	client_update_state(c);
+void ipc_init(void) {
+	runtime_path(ipc_path, sizeof(ipc_path), ".sock");
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	strcpy(addr.sun_path, ipc_path);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	unlink(ipc_path);
+	if (fd < 0 || bind(fd, (struct sockaddr*) &addr, sizeof(addr)) || listen(fd, 8)) {
+		fprintf(stderr, "tfwm: cannot listen on %s\n", ipc_path);
+		if (fd >= 0) close(fd);
+		return;
+	}
+	loop_watch(&ipc_watch, fd, ipc_accept, NULL);
+	setenv("TFWM_SOCKET", ipc_path, true);
 }
 
-void client_show(client_t* c) {
-	if (!c->hidden) return;
-	c->hidden = false;
-	XMoveWindow(display, c->window, c->x, c->y);
-	client_update_state(c);
+void ipc_cleanup(void) {
+	if (ipc_watch.fd < 0) return;
+	close(ipc_watch.fd);
+	unlink(ipc_path);
 }
 
-void client_anchor(client_t* c, anchor_t anchor) {
-	if (c->anchor == anchor) return;
-	if (c->anchor == ANCHOR_NONE) {
-		c->px = c->x;
-		c->py = c->y;
-		c->pw = c->w;
-		c->ph = c->h;
-	}
-	switch (anchor) {
-		case ANCHOR_NONE: client_move_resize(c, c->px, c->py, c->pw, c->ph); break;
-		case ANCHOR_TOP: client_move_resize(c, -border_width, bar_height, screen_width + 2*border_width, view_height + 2*border_width); break;
-		case ANCHOR_TOP_LEFT: client_move_resize(c, -border_width, bar_height, screen_width / 2, view_height / 2); break;
-		case ANCHOR_TOP_RIGHT: client_move_resize(c, screen_width / 2, bar_height, screen_width / 2, view_height / 2); break;
-		case ANCHOR_LEFT: client_move_resize(c, -border_width, bar_height, screen_width / 2, view_height); break;
-		case ANCHOR_RIGHT: client_move_resize(c, screen_width / 2, bar_height, screen_width / 2, view_height); break;
-		case ANCHOR_BOT_LEFT: client_move_resize(c, -border_width, view_height / 2 + bar_height, screen_width / 2, view_height / 2); break;
-		case ANCHOR_BOT_RIGHT: client_move_resize(c, screen_width / 2, view_height / 2 + bar_height, screen_width / 2, view_height / 2); break;
+// Record
+struct record_header {
+	char magic[8];
+	uint32_t root;
+	uint32_t bars[OUTPUT_MAX];
+	uint32_t atoms[64];
+};
+
+// Each event is stored as its time since the previous one and the bytes of its struct
+struct record_event {
+	uint32_t delta;
+	uint32_t size;
+};
+
+Atom* record_atoms[] = {
+	&_NET_ACTIVE_WINDOW, &_NET_CLIENT_LIST, &_NET_CLIENT_LIST_STACKING,
+	&_NET_DESKTOP_GEOMETRY, &_NET_NUMBER_OF_DESKTOPS, &_NET_SUPPORTED,
+	&_NET_SUPPORTING_WM_CHECK, &_NET_WM_BYPASS_COMPOSITOR, &_NET_WM_NAME,
+	&_NET_WM_STATE, &_NET_WM_STATE_DEMANDS_ATTENTION, &_NET_WM_STATE_FULLSCREEN,
+	&_NET_WM_STATE_HIDDEN, &_NET_WM_STATE_MAXIMIZED_VERT, &_NET_WM_STATE_MAXIMIZED_HORZ,
+	&_NET_WM_SYNC_REQUEST, &_NET_WM_SYNC_REQUEST_COUNTER, &_NET_WM_WINDOW_TYPE,
+	&_NET_WM_WINDOW_TYPE_TOOLBAR, &_TFWM_STATE, &UTF8_STRING,
+	&WM_CHANGE_STATE, &WM_DELETE_WINDOW, &WM_PROTOCOLS, &WM_STATE,
+};
+const int record_atom_count = sizeof(record_atoms) / sizeof(record_atoms[0]);
+_Static_assert(sizeof(record_atoms) / sizeof(record_atoms[0]) <= sizeof(((struct record_header*) 0)->atoms) / sizeof(uint32_t), "record header has no room for every atom");
+const char record_magic[8] = "TFWMREC1";
+FILE* record_file = NULL;
+long long record_last;
+
+size_t record_size(int type) {
+	switch (type) {
+		case ButtonPress: case ButtonRelease: return sizeof(XButtonEvent);
+		case ClientMessage: return sizeof(XClientMessageEvent);
+		case ConfigureRequest: return sizeof(XConfigureRequestEvent);
+		case DestroyNotify: return sizeof(XDestroyWindowEvent);
+		case EnterNotify: return sizeof(XCrossingEvent);
+		case Expose: return sizeof(XExposeEvent);
+		case KeyPress: return sizeof(XKeyEvent);
+		case MapNotify: return sizeof(XMapEvent);
+		case MappingNotify: return sizeof(XMappingEvent);
+		case MapRequest: return sizeof(XMapRequestEvent);
+		case MotionNotify: return sizeof(XMotionEvent);
+		case PropertyNotify: return sizeof(XPropertyEvent);
+		case UnmapNotify: return sizeof(XUnmapEvent);
+		default: return 0;
 	}
-	c->anchor = anchor;
-	client_update_state(c);
 }
 
-void client_focus(client_t* c) {
-	if (focused)
-		XSetWindowBorder(display, focused->window, colors[COLOR_BORDER]);
-	if (c)
-		XSetWindowBorder(display, c->window, colors[COLOR_BORDER_FOCUS]);
-	focused = c;
-	XSetInputFocus(display, c ? c->window : root, RevertToPointerRoot, CurrentTime);
-	Window none = None;
-	XChangeProperty(display, root, _NET_ACTIVE_WINDOW, XA_WINDOW, 32, PropModeReplace, (unsigned char*) (c ? &c->window : &none), 1);
-	bar_draw();
+// The header keeps the recording server's ids so replay can translate them
+bool record_open(const char* path) {
+	record_file = fopen(path, "wbe");
+	if (!record_file) {
+		fprintf(stderr, "tfwm: cannot record to %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	struct record_header header = { 0 };
+	memcpy(header.magic, record_magic, sizeof(header.magic));
+	header.root = root;
+	for (int i = 0; i < output_count; i++)
+		header.bars[i] = outputs[i].bar;
+	for (int i = 0; i < record_atom_count; i++)
+		header.atoms[i] = *record_atoms[i];
+	fwrite(&header, sizeof(header), 1, record_file);
+	record_last = time_now();
+	return true;
 }
 
-void client_lower(client_t* c) {
-	XLowerWindow(display, c->window);
-	XLowerWindow(display, bar);
+void record_write(XEvent* e, uint32_t size) {
+	long long now = time_now();
+	struct record_event r = { now - record_last, size };
+	record_last = now;
+	fwrite(&r, sizeof(r), 1, record_file);
+	fwrite(e, size, 1, record_file);
 }
 
-void client_raise(client_t* c) {
-	if (c->hidden) client_show(c);
-	XRaiseWindow(display, c->window);
-	client_focus(c);
+// Extension events carry server side ids that mean nothing on replay
+void record_event(XEvent* e) {
+	if (!record_file) return;
+	size_t size = record_size(e->type);
+	if (size) record_write(e, size);
 }
 
-// Window
-void window_get_title(Window window, char* buffer, size_t size) {
-	XTextProperty prop;
-	if (!XGetTextProperty(display, window, &prop, XA_WM_NAME))
-		return;
-	if (prop.encoding == XA_STRING) {
-		strncpy(buffer, (char*) prop.value, size - 1);
-		if (strlen((char*) prop.value) >= size - 1)
-			strcpy(buffer + size - 4, "...");
-	} else {
-		char** list = NULL;
-		int count = 0;
-		int ret = XmbTextPropertyToTextList(display, &prop, &list, &count);
-		if (ret >= Success && count > 0 && list[0] != NULL) {
-			strncpy(buffer, list[0], size - 1);
-			if (strlen(list[0]) >= size - 1)
-				strcpy(buffer + size - 4, "...");
-			XFreeStringList(list);
-		}
-	}
-	XFree(prop.value);
+// An empty record marks where the batch was finished
+void record_batch(void) {
+	if (record_file) record_write(NULL, 0);
 }
 
 // Event handlers
-XWindowAttributes grab_attr;
-XButtonEvent grab_start;
 
 void handle_button_press(XButtonEvent* e) {
-	if (e->window == bar) {
-		int x = 4;
-		for (client_t* c = clients; c; c = c->next) {
-			int width = (strlen(c->name) + 2) * xft_font->max_advance_width;
-			if (e->x_root - x <= width) {
-				if (e->button == 1)
-					client_raise(c);
-				else if (e->button == 3)
-					client_close(c);
-				break;
-			}
-			x += width + xft_font->max_advance_width;
-		}
+	output_t* o = output_of_bar(e->window);
+	if (o) {
+		client_t* c = bar_client_at(o, e->x);
+		if (!c) return;
+		if (e->button == 1)
+			client_raise(c);
+		else if (e->button == 3)
+			client_close(c);
 	} else {
 		client_t* c = client_find(e->subwindow);
 		if (c == NULL)
 			return;
-		XRaiseWindow(display, c->window);
+		stack_raise(c);
+		if (c->fullscreen)
+			return;
 		XGrabPointer(display, c->window, false, PointerMotionMask | ButtonReleaseMask, GrabModeAsync, GrabModeAsync, None, None, CurrentTime);
-		XGetWindowAttributes(display, c->window, &grab_attr);
-		grab_start = *e;
+		stats_round_trip();
+		drag_begin(c, e);
 	}
 }
 
 void handle_button_release(XButtonEvent* e) {
+	drag_end();
 	client_t* c = client_find(e->subwindow);
 	if (c) client_focus(c);
 	XUngrabPointer(display, CurrentTime);
-	XSync(display, false);
 }
 
 void handle_client_message(XClientMessageEvent* e) {
@@ -373,6 +2937,12 @@ void handle_client_message(XClientMessageEvent* e) {
 				case 1: client_anchor(c, ANCHOR_TOP); break;
 				case 2: client_anchor(c, c->anchor == ANCHOR_NONE ? ANCHOR_TOP : ANCHOR_NONE); break;
 			}
+		} else if (e->data.l[1] == (long) _NET_WM_STATE_FULLSCREEN || e->data.l[2] == (long) _NET_WM_STATE_FULLSCREEN) {
+			switch (e->data.l[0]) {
+				case 0: client_fullscreen(c, false); break;
+				case 1: client_fullscreen(c, true); break;
+				case 2: client_fullscreen(c, !c->fullscreen); break;
+			}
 		} else if (e->data.l[1] == (long) _NET_WM_STATE_HIDDEN) {
 			switch (e->data.l[0]) {
 				case 0: client_show(c); break;
@@ -382,6 +2952,8 @@ void handle_client_message(XClientMessageEvent* e) {
 		} else {
 			char* n1 = e->data.l[1] ? XGetAtomName(display, e->data.l[1]) : NULL;
 			char* n2 = e->data.l[2] ? XGetAtomName(display, e->data.l[2]) : NULL;
+			if (n1) stats_round_trip();
+			if (n2) stats_round_trip();
 			fprintf(stderr, "unimplemented _NET_WM_STATE: %ld %s %s\n", e->data.l[0], n1 ? n1 : "", n2 ? n2 : "");
 			if (n1) XFree(n1);
 			if (n2) XFree(n2);
@@ -393,6 +2965,7 @@ void handle_client_message(XClientMessageEvent* e) {
 		}
 	} else {
 		char* n = XGetAtomName(display, e->message_type);
+		stats_round_trip();
 		fprintf(stderr, "unimplemented Client Message: %s\n", n);
 		if (n) XFree(n);
 	}
@@ -402,11 +2975,30 @@ void handle_configure_request(XConfigureRequestEvent* e) {
 	client_t* c = client_find(e->window);
 	if (!c) return;
 
-	c->hidden = false;
-	c->x = e->x;
-	c->y = e->y;
-	c->w = e->width;
-	c->h = e->height;
+	// Fullscreen clients may only restack
+	if (c->fullscreen)
+		e->value_mask &= CWSibling | CWStackMode;
+	if (e->value_mask & CWX) c->x = e->x;
+	if (e->value_mask & CWY) c->y = e->y;
+	if (e->value_mask & CWWidth) c->w = e->width;
+	if (e->value_mask & CWHeight) c->h = e->height;
+	client_update_output(c);
+
+	// Stacking goes through the stack so the next flush does not undo it
+	client_t* sibling = e->value_mask & CWSibling ? client_find(e->above) : NULL;
+	if ((e->value_mask & CWStackMode) && !c->pending && (sibling || !(e->value_mask & CWSibling))) {
+		switch (e->detail) {
+			case Above: sibling ? stack_place(c, sibling, true) : stack_raise(c); break;
+			case Below: sibling ? stack_place(c, sibling, false) : stack_lower(c); break;
+			case TopIf: if (stack_occluded(c, sibling, true)) stack_raise(c); break;
+			case BottomIf: if (stack_occluded(c, sibling, false)) stack_lower(c); break;
+			case Opposite:
+				if (stack_occluded(c, sibling, true)) stack_raise(c);
+				else if (stack_occluded(c, sibling, false)) stack_lower(c);
+				break;
+		}
+	}
+	e->value_mask &= ~(CWSibling | CWStackMode);
 
 	XWindowChanges changes;
 	changes.x = e->x;
@@ -417,57 +3009,49 @@ void handle_configure_request(XConfigureRequestEvent* e) {
 	changes.sibling = e->above;
 	changes.stack_mode = e->detail;
 	XConfigureWindow(display, e->window, e->value_mask, &changes);
-	XSync(display, false);
 }
 
+void handle_destroy_notify(XDestroyWindowEvent* e) {
+	client_t* c = client_find(e->window);
+	if (c) client_remove(c);
+}
+
+void focus_fire(void* data) {
+	client_t* c = data;
+	if (c && c->hidden)
+		return;
+	client_focus(c);
+}
+
+// Focus follows the pointer only once it rests, sweeping across windows just moves the target
 void handle_enter_notify(XCrossingEvent* e) {
-	if (e->window == bar)
+	if (output_of_bar(e->window) || (e->window == root && client_any_visible())) {
+		timer_stop(&focus_timer);
 		return;
-	if (e->window == root && client_any_visible())
+	}
+	client_t* c = client_find(e->window);
+	if (c == focused) {
+		timer_stop(&focus_timer);
 		return;
-	client_focus(client_find(e->window));
+	}
+	focus_timer.callback = focus_fire;
+	focus_timer.data = c;
+	timer_start(&focus_timer, focus_delay * 1000LL);
 }
 
 void handle_expose(XExposeEvent* e) {
-	if (e->window == bar)
-		bar_draw();
+	output_t* o = output_of_bar(e->window);
+	if (o)
+		XCopyArea(display, o->pixmap, o->bar, gc, e->x, e->y, e->width, e->height, e->x, e->y);
 	else if (e->window == root)
 		XClearArea(display, root, e->x, e->y, e->width, e->height, false);
 }
 
-bool handle_key_press(XKeyEvent* e) {
-	KeySym key = XkbKeycodeToKeysym(display, e->keycode, 0, 0);
+void handle_key_press(XKeyEvent* e) {
 	unsigned int mask = e->state & (Mod1Mask | Mod4Mask | ShiftMask);
-	for (size_t i = 0; i < shortcut_count; i++) {
-		struct shortcut shortcut = shortcuts[i];
-		if (key != shortcut.key || mask != shortcut.mask)
-			continue;
-		if (shortcut.command[0] != '!') {
-			if (fork())
-				return false;
-			if (display)
-				close(ConnectionNumber(display));
-			setsid();
-			const char* command[4] = { "/bin/sh", "-c", shortcut.command, NULL };
-			execvp((char*) command[0], (char**) command);
-			exit(EXIT_SUCCESS);
-		} else if (!strcmp(shortcut.command, "!change")) {
-			client_t* c = focused ? focused : clients;
-			if (c) client_raise(c->next ? c->next : clients);
-		} else if (!strcmp(shortcut.command, "!close")) {
-			client_t* c = client_find(e->subwindow);
-			if (c) client_close(c);
-		} else if (!strcmp(shortcut.command, "!hide")) {
-			client_t* c = client_find(e->subwindow);
-			if (c) client_hide(c);
-		} else if (!strcmp(shortcut.command, "!lower")) {
-			client_t* c = client_find(e->subwindow);
-			if (c) client_lower(c);
-		} else if (!strcmp(shortcut.command, "!quit")) {
-			return true;
-		}
-	}
-	return false;
+	for (struct key_binding* b = key_table[e->keycode]; b; b = b->next)
+		if (b->mask == mask)
+			b->action(e, b->argv);
 }
 
 void handle_map_notify(XMapEvent *e) {
@@ -476,115 +3060,357 @@ void handle_map_notify(XMapEvent *e) {
 	client_raise(c);
 }
 
-void handle_map_request(XMapRequestEvent* e) {
-	client_t* c = malloc(sizeof(*c));
-	c->window = e->window;
-	c->anchor = ANCHOR_NONE;
-	c->hidden = true;
-	c->next = clients;
-	clients = c;
-
-	XWindowAttributes attr;
-	XGetWindowAttributes(display, e->window, &attr);
+void handle_mapping_notify(XMappingEvent* e) {
+	XRefreshKeyboardMapping(e);
+	if (e->request == MappingModifier)
+		input_grab();
+	else if (e->request == MappingKeyboard) {
+		// The first keysym lookup fetches the new keymap
+		stats_round_trip();
+		keys_compile();
+	}
+}
 
-	int w;
-	if (attr.width > screen_width) w = screen_width;
-	else if (attr.width < 16) w = screen_width * 3 / 4;
-	else w = attr.width;
+void handle_map_request(XMapRequestEvent* e) {
+	client_t* c = client_find(e->window);
+	if (c) {
+		if (!c->pending)
+			client_show(c);
+		return;
+	}
+	c = client_create(e->window);
+	if (!c) return;
 
-	int h;
-	if (attr.height > view_height) h = view_height;
-	else if (attr.height < 16) h = (view_height) * 3 / 4;
-	else h = attr.height;
+	// Managed once the geometry reply arrives, after the title and protocols
+	XSelectInput(display, c->window, EnterWindowMask | PropertyChangeMask);
+	request_title(c->window);
+	request_protocols(c->window);
+	request_net_state(c->window);
+	request_hints(c->window);
+	request_class(c->window);
+	request_geometry(c->window);
+}
 
-	int x;
-	if (attr.x <= 0) x = (screen_width - w) / 2;
-	else x = attr.x;
+void handle_motion_notify(XMotionEvent* e) {
+	if (!drag.client || drag.client->window != e->window)
+		return;
+	drag_motion(e);
+	drag_update();
+}
 
-	int y;
-	if (attr.y <= 0) y = (view_height - h) / 2 + bar_height;
-	else if (attr.y < bar_height) y = bar_height;
-	else y = attr.y;
+void handle_property_notify(XPropertyEvent* e) {
+	if (e->atom == XA_WM_NAME && e->window == root) {
+		request_title(root);
+	} else if (e->atom == XA_WM_NAME || e->atom == _NET_WM_NAME) {
+		client_t* c = client_find(e->window);
+		if (c) title_refresh(c);
+	} else if (e->atom == WM_PROTOCOLS) {
+		if (client_find(e->window))
+			request_protocols(e->window);
+	} else if (e->atom == XA_WM_NORMAL_HINTS) {
+		if (client_find(e->window))
+			request_hints(e->window);
+	} else if (e->atom == _NET_WM_BYPASS_COMPOSITOR) {
+		if (client_find(e->window))
+			request_bypass(e->window);
+	}
+}
 
-	window_get_title(c->window, c->name, sizeof(c->name));
-	client_move_resize(c, x, y, w, h);
+void handle_sync_alarm_notify(XSyncAlarmNotifyEvent* e) {
+	if (e->alarm != drag.alarm)
+		return;
+	drag.sync_sent = 0;
+	drag_update();
+}
 
-	XAddToSaveSet(display, c->window);
-	XSelectInput(display, c->window, EnterWindowMask | PropertyChangeMask);
-	XChangeProperty(display, root, _NET_CLIENT_LIST, XA_WINDOW, 32, PropModeAppend, (unsigned char*) &c->window, 1);
-	XConfigureWindow(display, c->window, CWBorderWidth, &(XWindowChanges){.border_width=border_width});
-	XSetWindowBorder(display, c->window, colors[COLOR_BORDER_FOCUS]);
-	XMapWindow(display, c->window);
+#ifdef XRANDR
+// Screen, CRTC and output notifies come in bursts, the outputs are rebuilt once per batch
+void handle_screen_change_notify(XEvent* e) {
+	XRRUpdateConfiguration(e);
+	screen_stale = true;
 }
+#endif
 
-void handle_motion_notify(XMotionEvent* e) {
+// Unmaps we caused by hiding are skipped, synthetic ones are clients withdrawing
+void handle_unmap_notify(XUnmapEvent* e) {
 	client_t* c = client_find(e->window);
 	if (!c) return;
+	if (c->ignore_unmaps && !e->send_event) {
+		c->ignore_unmaps--;
+		return;
+	}
+	client_remove(c);
+}
 
-	int mx = e->x_root;
-	int my = e->y_root;
-	if (grab_start.button == 1) {
-		if (mx == 0 && my == 0)
-			client_anchor(c, ANCHOR_TOP_LEFT);
-		else if (mx == screen_width - 1 && my == 0)
-			client_anchor(c, ANCHOR_TOP_RIGHT);
-		else if (mx == 0 && my == screen_height - 1)
-			client_anchor(c, ANCHOR_BOT_LEFT);
-		else if (mx == screen_width - 1 && my == screen_height - 1)
-			client_anchor(c, ANCHOR_BOT_RIGHT);
-		else if (my == 0)
-			client_anchor(c, ANCHOR_TOP);
-		else if (mx == 0)
-			client_anchor(c, ANCHOR_LEFT);
-		else if (mx == screen_width - 1)
-			client_anchor(c, ANCHOR_RIGHT);
-		else {
-			if (c->anchor != ANCHOR_NONE) {
-				client_anchor(c, ANCHOR_NONE);
-				grab_attr.x = grab_start.x_root - c->w / 2;
-				grab_attr.y = grab_start.y_root - c->h / 2;
+// Event batching
+XEvent event_batch[EVENT_BATCH_SIZE];
+bool event_dropped[EVENT_BATCH_SIZE];
+size_t event_count = 0;
+
+Window event_window(XEvent* e) {
+	switch (e->type) {
+		case ConfigureRequest: return e->xconfigurerequest.window;
+		case DestroyNotify: return e->xdestroywindow.window;
+		case MapNotify: return e->xmap.window;
+		case MapRequest: return e->xmaprequest.window;
+		case UnmapNotify: return e->xunmap.window;
+		default: return e->xany.window;
+	}
+}
+
+bool event_is_input(XEvent* e) {
+	return e->type == KeyPress || e->type == ButtonPress || e->type == ButtonRelease;
+}
+
+// Folds an older event into a newer one, returning whether the older can be dropped
+bool event_merge(XEvent* older, XEvent* newer) {
+	switch (newer->type) {
+		case ConfigureRequest: {
+			XConfigureRequestEvent* o = &older->xconfigurerequest;
+			XConfigureRequestEvent* n = &newer->xconfigurerequest;
+			unsigned long missing = o->value_mask & ~n->value_mask;
+			if (missing & CWX) n->x = o->x;
+			if (missing & CWY) n->y = o->y;
+			if (missing & CWWidth) n->width = o->width;
+			if (missing & CWHeight) n->height = o->height;
+			if (missing & CWBorderWidth) n->border_width = o->border_width;
+			if (missing & CWSibling) n->above = o->above;
+			if (missing & CWStackMode) n->detail = o->detail;
+			n->value_mask |= o->value_mask;
+			return true;
+		}
+		case EnterNotify:
+		case MotionNotify:
+			return true;
+		case Expose: {
+			XExposeEvent* o = &older->xexpose;
+			XExposeEvent* n = &newer->xexpose;
+			int x2 = n->x + n->width > o->x + o->width ? n->x + n->width : o->x + o->width;
+			int y2 = n->y + n->height > o->y + o->height ? n->y + n->height : o->y + o->height;
+			if (o->x < n->x) n->x = o->x;
+			if (o->y < n->y) n->y = o->y;
+			n->width = x2 - n->x;
+			n->height = y2 - n->y;
+			return true;
+		}
+		case PropertyNotify:
+			return older->xproperty.atom == newer->xproperty.atom;
+		default:
+			return false;
+	}
+}
+
+void event_coalesce(void) {
+	for (size_t i = 1; i < event_count; i++) {
+		XEvent* newer = &event_batch[i];
+		Window window = event_window(newer);
+		for (size_t j = i; j-- > 0;) {
+			if (event_dropped[j])
+				continue;
+			XEvent* older = &event_batch[j];
+			if (event_is_input(older) || event_is_input(newer))
+				break;
+			bool same_window = event_window(older) == window;
+			if (older->type == newer->type && (same_window || newer->type == EnterNotify)) {
+				if (event_merge(older, newer)) {
+					event_dropped[j] = true;
+					break;
+				}
+			} else if (same_window) {
+				break;
 			}
-			client_move(c, grab_attr.x + mx - grab_start.x_root, grab_attr.y + my - grab_start.y_root);
 		}
-	} else if (grab_start.button == 3 && c->anchor == ANCHOR_NONE) {
-		int width = grab_attr.width + mx - grab_start.x_root;
-		int height = grab_attr.height + my - grab_start.y_root;
-		if (width < 64) width = 64;
-		if (height < 32) height = 32;
-		client_resize(c, width, height);
 	}
 }
 
-void handle_property_notify(XPropertyEvent* e) {
-	if (e->atom != XA_WM_NAME)
-		return;
-	if (e->window == root) {
-		window_get_title(e->window, bar_status, sizeof(bar_status));
-	} else {
-		client_t* c = client_find(e->window);
-		if (!c) return;
-		window_get_title(c->window, c->name, sizeof(c->name));
+void event_dispatch(XEvent* e) {
+	switch (e->type) {
+		case ButtonPress: handle_button_press(&e->xbutton); break;
+		case ButtonRelease: handle_button_release(&e->xbutton); break;
+		case ClientMessage: handle_client_message(&e->xclient); break;
+		case ConfigureNotify: break;
+		case ConfigureRequest: handle_configure_request(&e->xconfigurerequest); break;
+		case CreateNotify: break;
+		case DestroyNotify: handle_destroy_notify(&e->xdestroywindow); break;
+		case EnterNotify: handle_enter_notify(&e->xcrossing); break;
+		case Expose: handle_expose(&e->xexpose); break;
+		case KeyPress: handle_key_press(&e->xkey); break;
+		case KeyRelease: break;
+		case MapNotify: handle_map_notify(&e->xmap); break;
+		case MappingNotify: handle_mapping_notify(&e->xmapping); break;
+		case MapRequest: handle_map_request(&e->xmaprequest); break;
+		case MotionNotify: handle_motion_notify(&e->xmotion); break;
+		case PropertyNotify: handle_property_notify(&e->xproperty); break;
+		case UnmapNotify: handle_unmap_notify(&e->xunmap); break;
+		default:
+			if (sync_supported && e->type == sync_event_base + XSyncAlarmNotify)
+				handle_sync_alarm_notify((XSyncAlarmNotifyEvent*) e);
+#ifdef XRANDR
+			else if (xrandr_supported && (e->type == xrandr_event_base + RRScreenChangeNotify || e->type == xrandr_event_base + RRNotify))
+				handle_screen_change_notify(e);
+#endif
+			else
+				fprintf(stderr, "Unhandled event %d\n", e->type);
+			break;
+	}
+}
+
+// Drains the queue, merges redundant events and dispatches what is left
+void event_process(void) {
+	event_count = 0;
+	while (event_count < EVENT_BATCH_SIZE && XPending(display)) {
+		XNextEvent(display, &event_batch[event_count]);
+		event_dropped[event_count++] = false;
+	}
+	event_coalesce();
+	for (size_t i = 0; i < event_count; i++) {
+		if (event_dropped[i]) {
+			stats_slot(event_batch[i].type)->coalesced++;
+			continue;
+		}
+		long long start = time_now();
+		unsigned long long round_trips = stats_round_trips;
+		size_t depth = event_count - i - 1 + XQLength(display);
+		record_event(&event_batch[i]);
+		event_dispatch(&event_batch[i]);
+		stats_record(stats_slot(event_batch[i].type), start, round_trips, depth);
+		if (quit)
+			return;
 	}
+}
+
+// Applies replies, writes out deferred state and sends queued requests
+void event_finish(void) {
+	record_batch();
+	screen_flush();
+	request_collect();
+	stack_flush();
+	props_flush();
 	bar_draw();
+	XFlush(display);
+	request_flush();
 }
 
-void handle_unmap_notify(XUnmapEvent* e) {
-	for (client_t** c = &clients; *c; c = &(*c)->next) {
-		if ((*c)->window != e->window)
+// Replay
+struct replay_window {
+	Window from, to;
+} replay_windows[REPLAY_WINDOWS];
+struct record_header replay_header;
+
+// Recorded windows get an unmapped stand-in the first time they show up
+Window replay_window(Window w) {
+	if (w == None) return None;
+	if (w == replay_header.root) return root;
+	for (int i = 0; i < OUTPUT_MAX; i++)
+		if (w == replay_header.bars[i])
+			return i < output_count ? outputs[i].bar : None;
+	size_t i = w % REPLAY_WINDOWS;
+	for (size_t n = 0; n < REPLAY_WINDOWS; n++, i = (i + 1) % REPLAY_WINDOWS) {
+		if (replay_windows[i].from == w)
+			return replay_windows[i].to;
+		if (replay_windows[i].from != None)
 			continue;
-		client_t* t = *c;
-		*c = (*c)->next;
-		free(t);
-		break;
+		Window to = XCreateSimpleWindow(display, root, 0, 0, 640, 480, 0, 0, 0);
+		XStoreName(display, to, "replay");
+		replay_windows[i] = (struct replay_window) { w, to };
+		return to;
 	}
+	return None;
+}
 
-	XDeleteProperty(display, root, _NET_CLIENT_LIST);
-	for (client_t* c = clients; c; c = c->next)
-		XChangeProperty(display, root, _NET_CLIENT_LIST, XA_WINDOW, 32, PropModeAppend, (unsigned char*) &c->window, 1);
+Atom replay_atom(Atom a) {
+	for (int i = 0; i < record_atom_count; i++)
+		if (a == replay_header.atoms[i])
+			return *record_atoms[i];
+	return a;
+}
 
-	bar_draw();
+void replay_translate(XEvent* e) {
+	e->xany.display = display;
+	e->xany.window = replay_window(e->xany.window);
+	switch (e->type) {
+		case ButtonPress:
+		case ButtonRelease:
+			e->xbutton.root = root;
+			e->xbutton.subwindow = replay_window(e->xbutton.subwindow);
+			break;
+		case ClientMessage:
+			e->xclient.message_type = replay_atom(e->xclient.message_type);
+			if (e->xclient.message_type == _NET_WM_STATE) {
+				e->xclient.data.l[1] = replay_atom(e->xclient.data.l[1]);
+				e->xclient.data.l[2] = replay_atom(e->xclient.data.l[2]);
+			}
+			break;
+		case ConfigureRequest:
+			e->xconfigurerequest.parent = replay_window(e->xconfigurerequest.parent);
+			e->xconfigurerequest.window = replay_window(e->xconfigurerequest.window);
+			e->xconfigurerequest.above = replay_window(e->xconfigurerequest.above);
+			break;
+		case DestroyNotify: e->xdestroywindow.window = replay_window(e->xdestroywindow.window); break;
+		case EnterNotify:
+			e->xcrossing.root = root;
+			e->xcrossing.subwindow = replay_window(e->xcrossing.subwindow);
+			break;
+		case KeyPress:
+			e->xkey.root = root;
+			e->xkey.subwindow = replay_window(e->xkey.subwindow);
+			break;
+		case MapNotify: e->xmap.window = replay_window(e->xmap.window); break;
+		case MapRequest:
+			e->xmaprequest.parent = replay_window(e->xmaprequest.parent);
+			e->xmaprequest.window = replay_window(e->xmaprequest.window);
+			break;
+		case MotionNotify:
+			e->xmotion.root = root;
+			e->xmotion.subwindow = replay_window(e->xmotion.subwindow);
+			break;
+		case PropertyNotify: e->xproperty.atom = replay_atom(e->xproperty.atom); break;
+		case UnmapNotify: e->xunmap.window = replay_window(e->xunmap.window); break;
+	}
 }
 
+// Feeds a recording through the handlers, at the original pace if asked, and prints the stats
+void replay_run(const char* path, bool realtime) {
+	FILE* f = fopen(path, "rbe");
+	if (!f || fread(&replay_header, sizeof(replay_header), 1, f) != 1 || memcmp(replay_header.magic, record_magic, sizeof(record_magic))) {
+		fprintf(stderr, "tfwm: cannot replay %s\n", path);
+		if (f) fclose(f);
+		return;
+	}
+	replaying = true;
+	memset(stats, 0, sizeof(stats));
+	stats_started = time_now();
+	long long due = stats_started;
+	struct record_event r;
+	XEvent e, live;
+	while (!quit && fread(&r, sizeof(r), 1, f) == 1) {
+		if (r.size > sizeof(e) || (r.size && fread(&e, r.size, 1, f) != 1))
+			break;
+		due += r.delta;
+		long long now = time_now();
+		if (realtime && due > now)
+			usleep(due - now);
+
+		// Events caused by the replay itself were recorded already
+		while (XPending(display))
+			XNextEvent(display, &live);
+		timer_run();
+		if (!r.size) {
+			event_finish();
+			continue;
+		}
+		replay_translate(&e);
+		long long start = time_now();
+		unsigned long long round_trips = stats_round_trips;
+		event_dispatch(&e);
+		stats_record(stats_slot(e.type), start, round_trips, 0);
+	}
+	fclose(f);
+	event_finish();
+	stats_dump(stdout);
+}
+
+
 // Main
 int error_event_handler(Display* d, XErrorEvent* e) {
 	char msg[256];
@@ -600,9 +3426,26 @@ int fatal_error_event_handler(Display* d, XErrorEvent* e) {
 	exit(EXIT_FAILURE);
 }
 
-int main(void) {
-	// Manage zombie processes
-	signal(SIGCHLD, SIG_IGN);
+int main(int argc, char** argv) {
+	const char* record_path = NULL;
+	const char* replay_path = NULL;
+	bool replay_realtime = false;
+	bool usage = false;
+	for (int i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "--record") && i + 1 < argc)
+			record_path = argv[++i];
+		else if (!strcmp(argv[i], "--replay") && i + 1 < argc)
+			replay_path = argv[++i];
+		else if (!strcmp(argv[i], "--realtime"))
+			replay_realtime = true;
+		else
+			usage = true;
+	}
+	// A replay would write its own batches into the recording, and only a replay has a pace
+	if (usage || (record_path && replay_path) || (replay_realtime && !replay_path)) {
+		fprintf(stderr, "usage: tfwm [--record file | --replay file [--realtime]]\n");
+		exit(EXIT_FAILURE);
+	}
 
 	// Connect to the X server
 	display = XOpenDisplay(NULL);
@@ -615,9 +3458,13 @@ int main(void) {
 	XSync(display, false);
 	XSetErrorHandler(error_event_handler);
 	XSync(display, false);
-	screen_width = DisplayWidth(display, DefaultScreen(display));
-	screen_height = DisplayHeight(display, DefaultScreen(display));
-	view_height = screen_height - bar_height;
+	connection = xcb_connect(NULL, NULL);
+	if (xcb_connection_has_error(connection)) {
+		fprintf(stderr, "tfwm: error opening request connection\n");
+		exit(EXIT_FAILURE);
+	}
+	fcntl(ConnectionNumber(display), F_SETFD, FD_CLOEXEC);
+	fcntl(xcb_get_file_descriptor(connection), F_SETFD, FD_CLOEXEC);
 	root = DefaultRootWindow(display);
 	gc = XCreateGC(display, root, 0, 0);
 	XSelectInput(display, root,
@@ -629,88 +3476,94 @@ int main(void) {
 	// Initialize atoms
 	atom_init();
 
+	// Initialize sync extension
+	int sync_error_base, sync_major, sync_minor;
+	if (XSyncQueryExtension(display, &sync_event_base, &sync_error_base))
+		sync_supported = XSyncInitialize(display, &sync_major, &sync_minor);
+
 	// Initialize root window
 	int cardinal = 1;
 	XChangeProperty(display, root, _NET_NUMBER_OF_DESKTOPS, XA_CARDINAL, 32, PropModeReplace, (unsigned char*) &cardinal, 1);
-	XChangeProperty(display, root, _NET_DESKTOP_GEOMETRY, XA_CARDINAL, 32, PropModeReplace, (unsigned char*) &screen_width, 1);
-	XChangeProperty(display, root, _NET_DESKTOP_GEOMETRY, XA_CARDINAL, 32, PropModeAppend, (unsigned char*) &screen_height, 1);
-
-	// Initialize bar
-	bar = XCreateSimpleWindow(display, root, 0, 0, screen_width, bar_height - border_width, 0, 0, 0);
-	XChangeProperty(display, bar, _NET_WM_WINDOW_TYPE, XA_ATOM, 32, PropModeReplace, (unsigned char*) &_NET_WM_WINDOW_TYPE_TOOLBAR, 1);
-	XSelectInput(display, bar, ExposureMask | ButtonPressMask);
-	XConfigureWindow(display, bar, CWBorderWidth, &(XWindowChanges){.border_width=border_width});
-	XSetWindowBorder(display, bar, colors[COLOR_BORDER_FOCUS]);
-	XMapWindow(display, bar);
-
-	// Colors
-	Visual* visual = DefaultVisual(display, DefaultScreen(display));
-	Colormap colormap = DefaultColormap(display, DefaultScreen(display));
-	xft_draw = XftDrawCreate(display, bar, visual, colormap);
-	xft_font = XftFontOpenName(display, DefaultScreen(display), font);
+	Atom supported[] = {
+		_NET_ACTIVE_WINDOW, _NET_CLIENT_LIST, _NET_CLIENT_LIST_STACKING, _NET_DESKTOP_GEOMETRY,
+		_NET_NUMBER_OF_DESKTOPS, _NET_SUPPORTING_WM_CHECK, _NET_WM_BYPASS_COMPOSITOR,
+		_NET_WM_STATE, _NET_WM_STATE_DEMANDS_ATTENTION, _NET_WM_STATE_FULLSCREEN,
+		_NET_WM_STATE_HIDDEN, _NET_WM_STATE_MAXIMIZED_VERT, _NET_WM_STATE_MAXIMIZED_HORZ,
+		_NET_WM_SYNC_REQUEST,
+	};
+	XChangeProperty(display, root, _NET_SUPPORTED, XA_ATOM, 32, PropModeReplace, (unsigned char*) supported, sizeof(supported) / sizeof(supported[0]));
+	Window check = XCreateSimpleWindow(display, root, -1, -1, 1, 1, 0, 0, 0);
+	XChangeProperty(display, check, _NET_SUPPORTING_WM_CHECK, XA_WINDOW, 32, PropModeReplace, (unsigned char*) &check, 1);
+	XChangeProperty(display, check, _NET_WM_NAME, UTF8_STRING, 8, PropModeReplace, (unsigned char*) "tfwm", 4);
+	XChangeProperty(display, root, _NET_SUPPORTING_WM_CHECK, XA_WINDOW, 32, PropModeReplace, (unsigned char*) &check, 1);
+
+	// Initialize outputs and their bars
+#ifdef XRANDR
+	// Outputs come from the monitor list, which needs RandR 1.5, older servers get one output
+	int xrandr_error_base, xrandr_major, xrandr_minor;
+	if (XRRQueryExtension(display, &xrandr_event_base, &xrandr_error_base)
+		&& XRRQueryVersion(display, &xrandr_major, &xrandr_minor)
+		&& (xrandr_major > 1 || (xrandr_major == 1 && xrandr_minor >= 5))) {
+		xrandr_supported = true;
+		XRRSelectInput(display, root, RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask | RROutputChangeNotifyMask);
+	}
+#endif
+	font_init();
+	bar_init_metrics();
+	screen_update();
+	bar_draw();
+	request_title(root);
 
 	// Grab necessary input
-	int lock_mods[] = { 0, LockMask, 0, LockMask };
-	XModifierKeymap* mk = XGetModifierMapping(display);
-	for (int i = 0; i < 8; i++) {
-		int kpm = mk->max_keypermod;
-		for (int j = 0; j < kpm; j++) {
-			if (mk->modifiermap[i * kpm + j] == XKeysymToKeycode(display, XK_Num_Lock)) {
-				lock_mods[2] |= 1 << i;
-				lock_mods[3] |= 1 << i;
-			}
-		}
-	}
-	XFreeModifiermap(mk);
-	for (int i = 0; i < 4; i++) {
-		XGrabButton(display, 1, lock_mods[i], bar, true, ButtonPressMask, GrabModeAsync, GrabModeAsync, None, None);
-		XGrabButton(display, 1, lock_mods[i] | Mod4Mask, root, true, ButtonPressMask, GrabModeAsync, GrabModeAsync, None, None);
-		XGrabButton(display, 3, lock_mods[i], bar, true, ButtonPressMask, GrabModeAsync, GrabModeAsync, None, None);
-		XGrabButton(display, 3, lock_mods[i] | Mod4Mask, root, true, ButtonPressMask, GrabModeAsync, GrabModeAsync, None, None);
-	}
-	for (size_t i = 0; i < shortcut_count; i++) {
-		KeyCode kc = XKeysymToKeycode(display, shortcuts[i].key);
-		for (int j = 0; j < 4; j++) {
-			XGrabKey(display, kc, lock_mods[j] | shortcuts[i].mask, root, true, GrabModeAsync, GrabModeAsync);
-		}
-	}
-
-	// Main loop
-	XEvent e;
-	bool quit = false;
-	while (!quit) {
-		XNextEvent(display, &e);
-		switch (e.type) {
-			case ButtonPress: handle_button_press(&e.xbutton); break;
-			case ButtonRelease: handle_button_release(&e.xbutton); break;
-			case ClientMessage: handle_client_message(&e.xclient); break;
-			case ConfigureNotify: break;
-			case ConfigureRequest: handle_configure_request(&e.xconfigurerequest); break;
-			case CreateNotify: break;
-			case DestroyNotify: break;
-			case EnterNotify: handle_enter_notify(&e.xcrossing); break;
-			case Expose: handle_expose(&e.xexpose); break;
-			case KeyPress: quit = handle_key_press(&e.xkey); break;
-			case KeyRelease: break;
-			case MapNotify: handle_map_notify(&e.xmap); break;
-			case MappingNotify: break;
-			case MapRequest: handle_map_request(&e.xmaprequest); break;
-			case MotionNotify:
-				while (XCheckTypedEvent(display, MotionNotify, &e));
-				handle_motion_notify(&e.xmotion);
-				break;
-			case PropertyNotify: handle_property_notify(&e.xproperty); break;
-			case UnmapNotify: handle_unmap_notify(&e.xunmap); break;
-			default:
-				fprintf(stderr, "Unhandled event %d\n", e.type);
-				break;
-		}
+	spawn_init();
+	input_grab();
+
+	// Take over windows that are already there
+	session_adopt();
+
+	// Main loop, reaping children and quitting on signals
+	watch_t x_watch, request_watch;
+	loop_init();
+	loop_watch(&x_watch, ConnectionNumber(display), NULL, NULL);
+	loop_watch(&request_watch, xcb_get_file_descriptor(connection), NULL, NULL);
+	stats_started = time_now();
+	status_init();
+	ipc_init();
+	if (record_path && !record_open(record_path))
+		exit(EXIT_FAILURE);
+	if (replay_path)
+		replay_run(replay_path, replay_realtime);
+	while (!quit && !replay_path) {
+		while (!quit && XPending(display))
+			event_process();
+		event_finish();
+		if (request_collect() || XEventsQueued(display, QueuedAlready))
+			continue;
+		if (!quit)
+			loop_wait();
 	}
 
-	// Clean up
-	XftFontClose(display, xft_font);
-	XftDrawDestroy(xft_draw);
+	// Clean up, handing the windows' state to the next instance on restart
+	if (restart)
+		session_save();
+	ipc_cleanup();
+	if (record_file)
+		fclose(record_file);
+	XDestroyWindow(display, check);
+	for (int i = 0; i < output_count; i++)
+		screen_destroy_bar(&outputs[i]);
+	font_cleanup();
+	posix_spawnattr_destroy(&spawn_attr);
 	XFreeGC(display, gc);
+	if (drag_frames[0] != None)
+		for (int i = 0; i < 4; i++)
+			XDestroyWindow(display, drag_frames[i]);
+	xcb_disconnect(connection);
 	XCloseDisplay(display);
+	if (restart) {
+		execvp(argv[0], argv);
+		fprintf(stderr, "tfwm: cannot restart: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
 	return 0;
 }